@@ -2,507 +2,2334 @@
 
 #include <sstream>
 
-#include <list>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
 #include <cstring>
+#include <cstdint>
+#include <cerrno>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/** Granularity of block sizes and alignment of the returned memory. */
+static const size_t GRANULE = 16;
+/** Marker of an absent block offset. */
+static const size_t NIL = (size_t)-1;
+/** Free flag in the block size tag. Block sizes are multiples of GRANULE, so
+  * the low bits of a tag are always available for flags.
+  */
+static const size_t TAG_FREE = 1;
+/** Mask of flag bits in the block size tag. */
+static const size_t TAG_FLAGS = GRANULE - 1;
+
+/**
+  * @brief Header placed at the beginning of every block inside the arena.
+  */
+struct BlockHeader {
+    /** Block size (header and footer included) with flags. */
+    size_t tag;
+    /** Handle slot of the allocated block. NIL_SLOT if the block is pinned:
+      * it has no handle and is never moved. Unused by free blocks.
+      */
+    uint32_t slot;
+    /** Log2 of the payload alignment of the allocated block. Zero if the
+      * block needs only the default GRANULE alignment.
+      */
+    uint32_t align_log2;
+};
+
+/**
+  * @brief Footer placed at the end of every block inside the arena. Makes the
+  * previous neighbour of a block reachable without any traversal.
+  */
+struct BlockFooter {
+    /** Copy of the header tag. */
+    size_t tag;
+};
+
+/**
+  * @brief Free list links kept in the payload of a free block.
+  */
+struct FreeLinks {
+    /** Offset of the previous free block of the same size class or NIL. */
+    size_t prev;
+    /** Offset of the next free block of the same size class or NIL. */
+    size_t next;
+};
+
+/** Metadata bytes of every block. */
+static const size_t BLOCK_OVERHEAD = sizeof(BlockHeader) + sizeof(BlockFooter);
+/** Minimal size of a block. Free block has to keep its free list links. */
+static const size_t MIN_BLOCK = (
+    sizeof(BlockHeader) + sizeof(FreeLinks) + sizeof(BlockFooter) +
+    GRANULE - 1
+) & ~(GRANULE - 1);
+
+/** Two-level size class index parameters. The first level is a power-of-two
+  * class, the second level splits each class into linear sub-classes. Blocks
+  * smaller than SMALL_BLOCK fall into exact-size classes.
+  */
+static const size_t GRANULE_LOG2 = 4;
+static const size_t SL_LOG2 = 4;
+static const size_t SL_COUNT = (size_t)1 << SL_LOG2;
+static const size_t SMALL_BLOCK = (size_t)1 << (SL_LOG2 + GRANULE_LOG2);
+static const size_t FL_COUNT = 64 - (SL_LOG2 + GRANULE_LOG2) + 1;
+/** The largest block size the index can handle. */
+static const size_t MAX_BLOCK = (size_t)1 << 62;
+
+/** Returns the index of the most significant bit of a non-zero value. */
+static inline size_t highestBit(size_t value)
+{
+    return 63 - __builtin_clzll((unsigned long long)value);
+}
+
+#ifdef ALLOCATOR_CHECKED
+/** Bytes added after every memory area by the checked build to catch
+  * overruns. The requested size is kept in the last bytes of the redzone.
+  */
+static const size_t REDZONE = 16;
+/** Fill of the redzones. */
+static const unsigned char REDZONE_BYTE = 0xfb;
+/** Fill of the freed memory. */
+static const unsigned char FREED_BYTE = 0xdd;
+#else
+static const size_t REDZONE = 0;
+#endif
+
+/** Returns the arena bytes occupied by a block with N bytes of payload. */
+static inline size_t blockSizeFor(size_t N)
+{
+    size_t size = (N + BLOCK_OVERHEAD + REDZONE + GRANULE - 1) &
+        ~(GRANULE - 1);
+    return (size < MIN_BLOCK) ? MIN_BLOCK : size;
+}
+
+/** Marker of the end of the unused slot list. */
+static const uint32_t NIL_SLOT = (uint32_t)-1;
+
+/** Handle table is a set of chunks. Chunk i holds SLOT_CHUNK << i slots, so
+  * chunks never move and the table grows without blocking readers.
+  */
+static const size_t SLOT_CHUNK_LOG2 = 10;
+static const size_t SLOT_CHUNK = (size_t)1 << SLOT_CHUNK_LOG2;
+static const size_t SLOT_CHUNKS = 32 - SLOT_CHUNK_LOG2 + 1;
+
+/**
+  * @brief Entry of the allocator handle table. Fields are atomic because
+  * pointers are resolved without taking the allocator lock.
+  */
+struct HandleSlot {
+    /** Offset of the referenced block. */
+    std::atomic<size_t> offset;
+    /** Incremented every time a pointer to the slot is freed. */
+    std::atomic<uint32_t> generation;
+    /** Next unused slot. Valid only for unused slots. */
+    uint32_t next_free;
+};
+
+/** Buckets of the allocation size histogram. */
+static const size_t SIZE_HISTOGRAM = 64;
+
+/** Per-thread caches keep freed blocks up to this size. */
+static const size_t CACHE_MAX_BLOCK = 1024;
+/** Cache size classes. Class of a block is its size in granules. */
+static const size_t CACHE_CLASSES = CACHE_MAX_BLOCK / GRANULE + 1;
+/** Blocks cached per size class. */
+static const size_t CACHE_DEPTH = 32;
+/** Blocks taken from the shared arena at once by an empty cache class. */
+static const size_t CACHE_BATCH = 8;
+
+/** Marks the arena holding the allocator state. */
+static const uint64_t ARENA_MAGIC = 0x414c4c4f43415245ULL;
+/** Layout version of the in-arena state. */
+static const uint32_t ARENA_VERSION = 4;
+
+/**
+  * @brief Allocator state which survives the allocator: the free block index
+  * and the handle table. Kept at the beginning of the arena by the in-arena
+  * allocators. Holds offsets only, so the arena may be mapped at another
+  * address when it is reattached.
+  */
+struct ArenaState {
+    /** ARENA_MAGIC when the state is initialized. */
+    uint64_t magic;
+    uint32_t version;
+    /** Whether the arena is shared between processes. */
+    uint32_t shared;
+    /** Arena size available for blocks. */
+    size_t size;
+    /** Protects the arena shared between processes. */
+    pthread_mutex_t shared_lock;
+
+    /** First level bitmap. Bit i is set when sl_bitmap[i] is not zero. */
+    uint64_t fl_bitmap;
+    /** Second level bitmaps. Bit j is set when heads[i][j] is not NIL. */
+    uint32_t sl_bitmap[FL_COUNT];
+    /** Heads of the free block lists. */
+    size_t heads[FL_COUNT][SL_COUNT];
+    /** Total size of the indexed free blocks. */
+    size_t free_bytes;
+    /** Number of the indexed free blocks. */
+    size_t free_blocks;
+    /** Size of the largest free block, valid when largest_known is set.
+      * Removing the largest block makes it unknown until it is asked for.
+      */
+    size_t largest_free;
+    uint32_t largest_known;
+
+    /** Incremental defragmentation position. Always a block boundary.
+      * Blocks before it have been compacted by the current pass.
+      */
+    size_t defrag_cursor;
+
+    /** Offsets of the pinned blocks holding the handle table chunks. Used
+      * by the in-arena allocators only.
+      */
+    size_t slot_chunks[SLOT_CHUNKS];
+    /** Number of slots ever used. */
+    size_t slot_count;
+    /** Head of the unused slot list. */
+    uint32_t free_slots;
+
+    /** Handle of the root memory area. */
+    uint32_t root_slot;
+    uint32_t root_generation;
+};
+
+/** Pointer constructor. Creates an invalid pointer. */
+Pointer::Pointer() noexcept:
+    allocator(nullptr), slot(NIL_SLOT), generation(0) { }
+
+/** Creates the pointer for a handle issued by the allocator. */
+Pointer::Pointer(
+    Allocator* _allocator, uint32_t _slot, uint32_t _generation
+) noexcept:
+    allocator(_allocator), slot(_slot), generation(_generation) { }
+
+/**
+  * @brief Lock of the allocator: either a process-local mutex or the
+  * process-shared one kept in the arena.
+  */
+class AllocatorLock {
+public:
+    AllocatorLock(): shared(nullptr) {}
+
+    void lock() {
+        if (!this->shared) {
+            this->local.lock();
+        } else if (pthread_mutex_lock(this->shared) == EOWNERDEAD) {
+            // The owner died holding the lock. The blocks it has been
+            // changing are lost, the rest of the arena is usable.
+            pthread_mutex_consistent(this->shared);
+        }
+    }
+
+    void unlock() {
+        if (this->shared) {
+            pthread_mutex_unlock(this->shared);
+        } else {
+            this->local.unlock();
+        }
+    }
+
+    /** The process-shared mutex or nullptr to use the local one. */
+    pthread_mutex_t* shared;
+
+private:
+    std::mutex local;
+};
 
 /**
-  * @brief Information structure for a memory space.
+  * @brief The Allocator implementation structure.
   */
-struct MemoryInfo {
-    /** Pointer to the beginning of the memory area. */
-    void* pointer;
-    /** Memory area size. */
+struct Allocator::AllocatorImpl
+{
+    /** The first block of the arena (aligned to GRANULE). */
+    unsigned char* begin;
+    /** Arena size available for blocks. */
     size_t size;
-    /** Whenever the memory area is free or allocated. */
-    bool is_freespace;
 
-    /** Simple constructor. */
-    MemoryInfo(void* p, size_t s, bool isf):
-        pointer(p), size(s), is_freespace(isf)
-        { }
+    /** Free block index and handle table state. Points either to the
+      * arena or to local_state.
+      */
+    ArenaState* state;
+    ArenaState local_state;
+    /** Whether the state is kept in the arena. */
+    bool in_arena;
+
+    /** Operation counters. Atomic because the thread cache paths do not
+      * take the lock.
+      */
+    std::atomic<size_t> alloc_count;
+    std::atomic<size_t> free_count;
+    std::atomic<size_t> realloc_count;
+    /** Allocations by requested size. See AllocatorStats. */
+    std::atomic<size_t> size_histogram[SIZE_HISTOGRAM];
+
+    /** Handle table chunks. Pointers refer to blocks through the table.
+      * Chunks of the in-arena table are resolved on the first use, other
+      * processes may add them.
+      */
+    mutable std::atomic<HandleSlot*> slot_chunks[SLOT_CHUNKS];
+
+    /** Whether the allocator is shared between threads. */
+    bool concurrent;
+    /** Whether freed small blocks are kept by thread caches. Cached blocks
+      * would leak from an arena which outlives the allocator, so in-arena
+      * allocators do not cache.
+      */
+    bool caching;
+    /** Protects the blocks and the handle table in the concurrent and the
+      * shared modes.
+      */
+    AllocatorLock lock;
+
+    struct ThreadCache;
+    struct ThreadCacheSet;
+    /** Per-thread caches of the allocator. Changed under both
+      * cacheRegistry() and the lock, so either of them protects it.
+      */
+    std::vector<ThreadCache*> caches;
+    /** Set while defrag moves blocks. Thread caches do not touch the arena
+      * then, see enterCache.
+      */
+    std::atomic<bool> moving;
+
+    /** Returns the header of the block at the offset. */
+    BlockHeader* header(size_t off) const {
+        return reinterpret_cast<BlockHeader*>(this->begin + off);
+    }
+    /** Returns the free list links of the free block at the offset. */
+    FreeLinks* links(size_t off) const {
+        return reinterpret_cast<FreeLinks*>(
+            this->begin + off + sizeof(BlockHeader)
+        );
+    }
+    /** Returns the size of the block at the offset. */
+    size_t blockSize(size_t off) const {
+        return this->header(off)->tag & ~TAG_FLAGS;
+    }
+    /** Whether the block at the offset is free. */
+    bool isFree(size_t off) const {
+        return (this->header(off)->tag & TAG_FREE) != 0;
+    }
+    /** Returns the payload of the block at the offset. */
+    void* payload(size_t off) const {
+        return this->begin + off + sizeof(BlockHeader);
+    }
+
+    /** Writes header and footer tags of the block. */
+    void setTags(size_t off, size_t size, bool is_free);
+    /** Grows the allocated block over the bytes right after it. The checked
+      * build moves the redzone size record to the new end of the block.
+      */
+    void growAllocated(size_t off, size_t size);
+
+    /** Resets the size class index. */
+    void clearFreeLists();
+    /** Adds a free block to the size class index. */
+    void insertFree(size_t off);
+    /** Removes a free block from the size class index. */
+    void removeFree(size_t off);
+    /** Counts the successful allocation of N bytes. */
+    void countAlloc(size_t N) {
+        this->alloc_count.fetch_add(1, std::memory_order_relaxed);
+        this->size_histogram[highestBit(N)].fetch_add(
+            1, std::memory_order_relaxed
+        );
+    }
+
+    /** Counts the successful realloc. */
+    void countRealloc() {
+        this->realloc_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /** Returns the size of the largest free block. When the largest block
+      * has been removed, the list of the highest non-empty size class is
+      * scanned once and the result is kept until the next removal of it.
+      */
+    size_t largestFree() const;
+    /** Returns the fragmentation of the free space: zero when all the free
+      * space is one block, close to one when it is scattered.
+      */
+    double fragmentation() const;
+    /** Keeps the defragmentation cursor on a block boundary when blocks of
+      * the range [first, last) are united into one.
+      */
+    void unitedRange(size_t first, size_t last) {
+        if ((first < this->state->defrag_cursor) && (this->state->defrag_cursor < last)) {
+            this->state->defrag_cursor = first;
+        }
+    }
+
+    /** Finds a free block which is at least of the specified size. The
+      * good fit: the first block of the next sub-class, which fits without
+      * looking at the block sizes. When there is none, the sub-class of the
+      * size itself is searched first fit, so a request close to the largest
+      * block still succeeds at the cost of a list walk.
+      * @arg size - required block size.
+      * @return Offset of the free block or NIL if not found.
+      */
+    size_t findFree(size_t size) const;
+
+    /** Cuts the tail of the block leaving the specified size. The tail
+      * becomes a free block, united with the next free block and indexed.
+      * Nothing is done if the tail is too small to be a block and there is
+      * no next free block to join.
+      * @arg off - block offset.
+      * @arg size - new block size.
+      */
+    void splitBlock(size_t off, size_t size);
+
+    /** Unites a free (not indexed) block with its free neighbours. The
+      * neighbours are removed from the index, the result is not indexed.
+      * @arg off - free block offset.
+      * @return Offset of the united block.
+      */
+    size_t UniteFreeSpace(size_t off);
+
+    /** Moves the run of allocated blocks [off, end) to the beginning of the
+      * previous free block with a single memmove and unites the free space
+      * after it with the next free block.
+      * @arg off - offset of the first allocated block of the run.
+      * @arg end - offset after the last block of the run.
+      * @arg pad - bytes left free before the run to keep its alignment.
+      * Either zero or at least MIN_BLOCK.
+      * @return Offset after the moved run. A space left behind which is too
+      * small to be a free block joins the last block of the run and is
+      * included. NIL if nothing has been done.
+      */
+    size_t moveToPreviousFree(size_t off, size_t end, size_t pad = 0);
+
+    /** Binds slots of the allocated blocks [first, last) to the offsets the
+      * blocks get when the range is moved to dst.
+      */
+    void relocateSlots(size_t first, size_t last, size_t dst);
+
+    /** Extends the allocated block to the next free block.
+      * @arg off - allocated block offset.
+      * @arg new_size - new block size.
+      * @return True if successful. False if nothing has been done.
+      */
+    bool extendToNextFree(size_t off, size_t new_size);
+
+    /** Extends the allocated block to both the previous and the next free
+      * blocks. The content is moved to the beginning of the previous one.
+      * @arg off - allocated block offset.
+      * @arg new_size - new block size.
+      * @return True if successful. False if nothing has been done.
+      */
+    bool extendToNeighbours(size_t off, size_t new_size);
+
+    /** Allocates a block of the specified size.
+      * @return Block offset or NIL if there is no free block to fit.
+      */
+    size_t allocBlock(size_t size);
+    /** Allocates a block of the specified size with the payload aligned to
+      * 2^align_log2. The padding before the block stays free.
+      * @return Block offset or NIL if there is no free block to fit.
+      */
+    size_t allocAlignedBlock(size_t size, uint32_t align_log2);
+
+    /** Whether the allocated block may be moved to the offset: it is not
+      * pinned and keeps its payload alignment there.
+      */
+    bool movableTo(size_t block, size_t dst) const {
+        const BlockHeader* header = this->header(block);
+        if (header->slot == NIL_SLOT) {
+            return dst == block;
+        }
+        return (header->align_log2 == 0) || (
+            ((uintptr_t)this->payload(dst) &
+            (((uintptr_t)1 << header->align_log2) - 1)) == 0
+        );
+    }
+    /** Returns the first offset not before dst where the payload is aligned
+      * to 2^align_log2 and the padding is either empty or large enough to
+      * be a free block.
+      */
+    size_t alignedPlace(size_t dst, uint32_t align_log2) const;
+    /** Returns the offset the allocated block is moved to when it is not
+      * movable to dst. Pinned blocks stay in place, aligned blocks never go
+      * further than their current place.
+      */
+    size_t placeFor(size_t block, size_t dst) const {
+        const BlockHeader* header = this->header(block);
+        if (header->slot == NIL_SLOT) {
+            return block;
+        }
+        size_t place = this->alignedPlace(dst, header->align_log2);
+        return (place < block) ? place : block;
+    }
+    /** Returns the allocated block to the free space. */
+    void freeBlock(size_t off);
+
+#ifdef ALLOCATOR_CHECKED
+    /** Fills the redzone after the first N bytes of the allocated block and
+      * records N at its end.
+      */
+    void stampRedzone(size_t off, size_t N);
+    /** Throws AllocError if the redzone of the allocated block is
+      * damaged.
+      */
+    void checkRedzone(size_t off) const;
+    /** Fills the memory area of the allocated block with FREED_BYTE. */
+    void poisonArea(size_t off);
+    /** Fills the payload of the block with FREED_BYTE. */
+    void poisonBlock(size_t off) {
+        memset(
+            this->payload(off), FREED_BYTE,
+            this->blockSize(off) - BLOCK_OVERHEAD
+        );
+    }
+#else
+    /** The release build does not check the memory areas. */
+    void stampRedzone(size_t, size_t) {}
+    void checkRedzone(size_t) const {}
+    void poisonArea(size_t) {}
+    void poisonBlock(size_t) {}
+#endif
+    /** Walks the arena and throws AllocError if the blocks, the free space
+      * index or the handle table are inconsistent. The checked build also
+      * verifies the redzones.
+      */
+    void verify() const;
+
+    /** Returns the handle table entry. Null if the slot has never been
+      * used.
+      */
+    HandleSlot* slotEntry(uint32_t slot) const {
+        size_t index = (size_t)slot + SLOT_CHUNK;
+        size_t chunk = highestBit(index);
+        HandleSlot* entries = this->slot_chunks[chunk - SLOT_CHUNK_LOG2].load(
+            std::memory_order_acquire
+        );
+        if (!entries && this->in_arena) {
+            entries = this->arenaChunk(chunk - SLOT_CHUNK_LOG2);
+        }
+        return entries ? &entries[index - ((size_t)1 << chunk)] : nullptr;
+    }
+    /** Resolves the handle table chunk kept in the arena. Null if it has
+      * not been added yet.
+      */
+    HandleSlot* arenaChunk(size_t chunk) const {
+        size_t off = __atomic_load_n(
+            &this->state->slot_chunks[chunk], __ATOMIC_ACQUIRE
+        );
+        if (off == NIL) {
+            return nullptr;
+        }
+        HandleSlot* entries = static_cast<HandleSlot*>(this->payload(off));
+        this->slot_chunks[chunk].store(entries, std::memory_order_release);
+        return entries;
+    }
+    /** Returns the block offset of the slot. */
+    size_t slotOffset(uint32_t slot) const {
+        return this->slotEntry(slot)->offset.load(std::memory_order_relaxed);
+    }
+    /** Binds the slot to the block offset. */
+    void bindSlot(uint32_t slot, size_t off) {
+        this->slotEntry(slot)->offset.store(off, std::memory_order_relaxed);
+        this->header(off)->slot = slot;
+    }
+    /** Returns the current slot generation. */
+    uint32_t slotGeneration(uint32_t slot) const {
+        return this->slotEntry(slot)->generation.load(
+            std::memory_order_relaxed
+        );
+    }
+
+    /** Binds an unused slot to the block. */
+    uint32_t acquireSlot(size_t off);
+    /** Makes all the pointers with the generation of the pointer stale. Only
+      * one of concurrent calls for the same generation succeeds.
+      * @return False if the pointer is already stale.
+      */
+    bool retireSlot(const Pointer& p);
+    /** Returns the slot to the unused ones. */
+    void releaseSlot(uint32_t slot);
+    /** Whether the pointer refers to a live block of this allocator. */
+    bool isLive(const Pointer& p) const {
+        HandleSlot* entry = this->slotEntry(p.slot);
+        return entry && (
+            entry->generation.load(std::memory_order_relaxed) == p.generation
+        );
+    }
+
+    /** Returns the cache of the calling thread. Creates it if necessary. */
+    ThreadCache* threadCache();
+    /** Returns cached blocks of the size class to the free space keeping
+      * the specified number of them. Requires the lock.
+      */
+    void flushCache(ThreadCache* cache, size_t cls, size_t keep);
+    /** Returns all the cached blocks to the free space. Requires the
+      * lock.
+      */
+    void flushCache(ThreadCache* cache);
+
+    /** Starts the use of the cache without the lock. Blocks are read and
+      * written in the arena only between enterCache and leaveCache.
+      * @return False if defrag is moving blocks: the lock has to be taken.
+      */
+    bool enterCache(ThreadCache* cache);
+    void leaveCache(ThreadCache* cache);
+    /** Waits for the caches used without the lock and keeps them out of the
+      * arena until resumeCaches. Requires the lock.
+      */
+    void stopCaches();
+    void resumeCaches() {
+        this->moving.store(false, std::memory_order_release);
+    }
+    /** Puts the block of the retired slot to the cache. Requires either
+      * the lock or the cache entered.
+      * @arg flush - makes room in the full size class. Requires the lock.
+      * @return False if the block is not kept by the cache.
+      */
+    bool cacheBlock(ThreadCache* cache, uint32_t slot, bool flush);
+};
+
+/**
+  * @brief Cache of freed blocks owned by a thread. Cached blocks stay
+  * allocated in the arena and keep their slots, so taking and putting them
+  * does not need the allocator lock. Generations of cached slots are never
+  * issued to a pointer.
+  */
+struct Allocator::AllocatorImpl::ThreadCache {
+    /** Allocator of the cache. Reset when the allocator is destroyed. */
+    std::atomic<AllocatorImpl*> owner;
+    /** Set while the thread uses the cache without the lock. */
+    std::atomic<bool> in_use;
+    /** Number of cached slots per size class. */
+    size_t count[CACHE_CLASSES];
+    /** Cached slots per size class. */
+    uint32_t slots[CACHE_CLASSES][CACHE_DEPTH];
+};
+
+/**
+  * @brief Caches of a thread for all the allocators it used. Returns the
+  * cached blocks to the allocators on the thread exit.
+  */
+struct Allocator::AllocatorImpl::ThreadCacheSet {
+    std::vector<ThreadCache*> caches;
+
+    ~ThreadCacheSet();
+};
+
+/** Protects the links between allocators and thread caches. */
+static std::mutex& cacheRegistry()
+{
+    static std::mutex registry;
+    return registry;
+}
+
+/** Holds the lock in the concurrent and the shared modes only. */
+class AllocatorGuard {
+public:
+    AllocatorGuard(AllocatorLock& m, bool concurrent):
+        lock(m, std::defer_lock)
+    {
+        if (concurrent) {
+            this->lock.lock();
+        }
+    }
+
+private:
+    std::unique_lock<AllocatorLock> lock;
 };
 
-/**
-  * @brief The Pointer implementation structure.
-  */
-struct Pointer::PointerImpl
-{
-    /** Allocator reference. If nullptr then the pointer is invalid. */
-    Allocator* allocator;
-    /** Iterator reference to a memory area. */
-    std::list<MemoryInfo>::iterator p;
+void Allocator::AllocatorImpl::setTags(size_t off, size_t size, bool is_free)
+{
+    size_t tag = size | (is_free ? TAG_FREE : 0);
+    this->header(off)->tag = tag;
+    reinterpret_cast<BlockFooter*>(
+        this->begin + off + size - sizeof(BlockFooter)
+    )->tag = tag;
+}
+
+void Allocator::AllocatorImpl::growAllocated(size_t off, size_t size)
+{
+#ifdef ALLOCATOR_CHECKED
+    size_t capacity = this->blockSize(off) - BLOCK_OVERHEAD;
+    size_t N;
+    memcpy(
+        &N,
+        static_cast<unsigned char*>(this->payload(off)) + capacity -
+            sizeof(size_t),
+        sizeof(size_t)
+    );
+    this->setTags(off, size, false);
+    this->stampRedzone(off, N);
+#else
+    this->setTags(off, size, false);
+#endif
+}
+
+/** Calculates first and second level indices of the block size. */
+static inline void mapping(size_t size, size_t &fl, size_t &sl)
+{
+    if (size < SMALL_BLOCK) {
+        fl = 0;
+        sl = size >> GRANULE_LOG2;
+    } else {
+        size_t msb = highestBit(size);
+        fl = msb - (SL_LOG2 + GRANULE_LOG2) + 1;
+        sl = (size >> (msb - SL_LOG2)) - SL_COUNT;
+    }
+}
+
+void Allocator::AllocatorImpl::clearFreeLists()
+{
+    this->state->free_bytes = 0;
+    this->state->free_blocks = 0;
+    this->state->largest_free = 0;
+    this->state->largest_known = 1;
+    this->state->fl_bitmap = 0;
+    for (size_t i = 0; i < FL_COUNT; i++) {
+        this->state->sl_bitmap[i] = 0;
+        for (size_t j = 0; j < SL_COUNT; j++) {
+            this->state->heads[i][j] = NIL;
+        }
+    }
+}
+
+void Allocator::AllocatorImpl::insertFree(size_t off)
+{
+    size_t size = this->blockSize(off);
+    size_t fl, sl;
+    mapping(size, fl, sl);
+
+    FreeLinks* l = this->links(off);
+    l->prev = NIL;
+    l->next = this->state->heads[fl][sl];
+    if (l->next != NIL) {
+        this->links(l->next)->prev = off;
+    }
+    this->state->heads[fl][sl] = off;
+    if (size > this->state->largest_free) {
+        this->state->largest_free = size;
+    }
+
+    this->state->sl_bitmap[fl] |= (uint32_t)1 << sl;
+    this->state->fl_bitmap |= (uint64_t)1 << fl;
+    this->state->free_bytes += this->blockSize(off);
+    this->state->free_blocks++;
+}
+
+void Allocator::AllocatorImpl::removeFree(size_t off)
+{
+    size_t size = this->blockSize(off);
+    size_t fl, sl;
+    mapping(size, fl, sl);
+
+    FreeLinks* l = this->links(off);
+    if (l->prev != NIL) {
+        this->links(l->prev)->next = l->next;
+    } else {
+        this->state->heads[fl][sl] = l->next;
+    }
+    if (l->next != NIL) {
+        this->links(l->next)->prev = l->prev;
+    }
+
+    // Another block of the same size may remain, it is looked for lazily
+    if (size == this->state->largest_free) {
+        this->state->largest_known = 0;
+    }
+
+    if (this->state->heads[fl][sl] == NIL) {
+        this->state->sl_bitmap[fl] &= ~((uint32_t)1 << sl);
+        if (this->state->sl_bitmap[fl] == 0) {
+            this->state->fl_bitmap &= ~((uint64_t)1 << fl);
+        }
+    }
+    this->state->free_bytes -= this->blockSize(off);
+    this->state->free_blocks--;
+}
+
+size_t Allocator::AllocatorImpl::largestFree() const
+{
+    if (this->state->fl_bitmap == 0) {
+        return 0;
+    }
+    if (this->state->largest_known) {
+        return this->state->largest_free;
+    }
+
+    size_t fl = highestBit(this->state->fl_bitmap);
+    size_t sl = highestBit(this->state->sl_bitmap[fl]);
+    size_t largest = 0;
+    for (size_t off = this->state->heads[fl][sl]; off != NIL;) {
+        if (this->blockSize(off) > largest) {
+            largest = this->blockSize(off);
+        }
+        off = this->links(off)->next;
+    }
+    this->state->largest_free = largest;
+    this->state->largest_known = 1;
+    return largest;
+}
+
+double Allocator::AllocatorImpl::fragmentation() const
+{
+    if (this->state->free_bytes == 0) {
+        return 0;
+    }
+    return 1.0 - (double)this->largestFree() / this->state->free_bytes;
+}
+
+size_t Allocator::AllocatorImpl::findFree(size_t size) const
+{
+    // Round the size up to the next sub-class so any block there fits
+    size_t rounded = size;
+    if (size >= SMALL_BLOCK) {
+        rounded += ((size_t)1 << (highestBit(size) - SL_LOG2)) - 1;
+    }
+    size_t fl, sl;
+    mapping(rounded, fl, sl);
+
+    uint32_t slMap = (sl < SL_COUNT) ?
+        this->state->sl_bitmap[fl] & (~(uint32_t)0 << sl) : 0;
+    if (slMap == 0) {
+        uint64_t flMap = this->state->fl_bitmap & (~(uint64_t)0 << (fl + 1));
+        if (flMap != 0) {
+            fl = __builtin_ctzll(flMap);
+            slMap = this->state->sl_bitmap[fl];
+        }
+    }
+    if (slMap != 0) {
+        return this->state->heads[fl][__builtin_ctz(slMap)];
+    }
+
+    // Blocks of the own sub-class may still fit, small ones are of one size
+    if (rounded == size) {
+        return NIL;
+    }
+    mapping(size, fl, sl);
+    for (size_t off = this->state->heads[fl][sl]; off != NIL;) {
+        if (this->blockSize(off) >= size) {
+            return off;
+        }
+        off = this->links(off)->next;
+    }
+    return NIL;
+}
+
+void Allocator::AllocatorImpl::splitBlock(size_t off, size_t size)
+{
+    size_t blockSize = this->blockSize(off);
+    if (blockSize == size) {
+        return;
+    } else if (blockSize - size < MIN_BLOCK) {
+        size_t next = off + blockSize;
+        if ((next >= this->size) || !this->isFree(next)) {
+            return;
+        }
+    }
+
+    bool is_free = this->isFree(off);
+    this->setTags(off, size, is_free);
+
+    size_t tail = off + size;
+    this->setTags(tail, blockSize - size, true);
+    this->insertFree(this->UniteFreeSpace(tail));
+}
+
+size_t Allocator::AllocatorImpl::UniteFreeSpace(size_t off)
+{
+    size_t size = this->blockSize(off);
+
+    // The next neighbour starts right after the block
+    size_t next = off + size;
+    if ((next < this->size) && this->isFree(next)) {
+        this->removeFree(next);
+        size += this->blockSize(next);
+    }
+
+    // The previous neighbour size is in its footer right before the block
+    if (off > 0) {
+        size_t prevTag = reinterpret_cast<BlockFooter*>(
+            this->begin + off - sizeof(BlockFooter)
+        )->tag;
+        if (prevTag & TAG_FREE) {
+            off -= prevTag & ~TAG_FLAGS;
+            this->removeFree(off);
+            size += prevTag & ~TAG_FLAGS;
+        }
+    }
+
+    this->setTags(off, size, true);
+    this->unitedRange(off, off + size);
+    return off;
+}
+
+size_t Allocator::AllocatorImpl::moveToPreviousFree(
+    size_t off, size_t end, size_t pad
+)
+{
+    // Simple checks
+    if ((off == 0) || this->isFree(off)) {
+        return NIL;
+    }
+
+    size_t prevTag = reinterpret_cast<BlockFooter*>(
+        this->begin + off - sizeof(BlockFooter)
+    )->tag;
+    if (!(prevTag & TAG_FREE)) {
+        return NIL;
+    }
+
+    size_t prevSize = prevTag & ~TAG_FLAGS;
+    size_t prev = off - prevSize;
+    size_t dst = prev + pad;
+    size_t tailSize = prevSize - pad;
+    bool nextIsFree = (end < this->size) && this->isFree(end);
+    this->removeFree(prev);
+
+    // Areas may cross, headers travel together with the content
+    this->relocateSlots(off, end, dst);
+    memmove(this->begin + dst, this->begin + off, end - off);
+
+    // The space left behind is united with the next free block. Without
+    // one, a space too small to be a free block joins the last block of the
+    // run: the padding of an aligned run leaves such spaces.
+    size_t tail = dst + (end - off);
+    if ((tailSize < MIN_BLOCK) && !nextIsFree) {
+        size_t last = dst;
+        while (last + this->blockSize(last) < tail) {
+            last += this->blockSize(last);
+        }
+        this->growAllocated(last, this->blockSize(last) + tailSize);
+        tail = end;
+    } else {
+        this->setTags(tail, tailSize, true);
+        this->insertFree(this->UniteFreeSpace(tail));
+    }
+
+    if (pad > 0) {
+        this->setTags(prev, pad, true);
+        this->insertFree(prev);
+    }
+
+    return tail;
+}
+
+void Allocator::AllocatorImpl::relocateSlots(
+    size_t first, size_t last, size_t dst
+)
+{
+    for (size_t off = first; off < last; off += this->blockSize(off)) {
+        this->slotEntry(this->header(off)->slot)->offset.store(
+            dst + (off - first), std::memory_order_relaxed
+        );
+    }
+}
+
+bool Allocator::AllocatorImpl::extendToNextFree(size_t off, size_t new_size)
+{
+    // Simple checks
+    if (this->isFree(off)) {
+        return false;
+    }
+
+    size_t size = this->blockSize(off);
+    size_t next = off + size;
+    if (next >= this->size) {
+        return false;
+    } else if (!this->isFree(next)) {
+        return false;
+    // Check if there is enough size to extend
+    } else if (this->blockSize(next) < new_size - size) {
+        return false;
+    }
+
+    // Extend the area
+    this->removeFree(next);
+    this->setTags(off, size + this->blockSize(next), false);
+    this->unitedRange(off, off + this->blockSize(off));
+    this->splitBlock(off, new_size);
+    return true;
+}
+
+bool Allocator::AllocatorImpl::extendToNeighbours(
+    size_t off, size_t new_size
+)
+{
+    // Simple checks
+    if ((off == 0) || this->isFree(off)) {
+        return false;
+    }
+
+    size_t prevTag = reinterpret_cast<BlockFooter*>(
+        this->begin + off - sizeof(BlockFooter)
+    )->tag;
+    if (!(prevTag & TAG_FREE)) {
+        return false;
+    }
+
+    size_t prevSize = prevTag & ~TAG_FLAGS;
+    size_t prev = off - prevSize;
+    size_t size = this->blockSize(off);
+    size_t next = off + size;
+    size_t nextSize = 0;
+    if ((next < this->size) && this->isFree(next)) {
+        nextSize = this->blockSize(next);
+    }
+
+    // Check if there is enough size to extend keeping the alignment
+    size_t united = prevSize + size + nextSize;
+    if ((united < new_size) || !this->movableTo(off, prev)) {
+        return false;
+    }
+
+    BlockHeader header = *this->header(off);
+    this->removeFree(prev);
+    if (nextSize > 0) {
+        this->removeFree(next);
+    }
+
+    // Only the payload is copied, the header is written at the new place
+    memmove(this->payload(prev), this->payload(off), size - BLOCK_OVERHEAD);
+    this->setTags(prev, united, false);
+    this->header(prev)->align_log2 = header.align_log2;
+    this->bindSlot(header.slot, prev);
+    this->unitedRange(prev, prev + united);
+
+    this->splitBlock(prev, new_size);
+    return true;
+}
+
+size_t Allocator::AllocatorImpl::allocBlock(size_t size)
+{
+    size_t off = this->findFree(size);
+    if (off == NIL) {
+        return NIL;
+    }
+
+    // Change the free block to an allocated one and return the rest
+    this->removeFree(off);
+    this->setTags(off, this->blockSize(off), false);
+    this->header(off)->align_log2 = 0;
+    this->splitBlock(off, size);
+    return off;
+}
+
+size_t Allocator::AllocatorImpl::alignedPlace(
+    size_t dst, uint32_t align_log2
+) const
+{
+    uintptr_t mask = ((uintptr_t)1 << align_log2) - 1;
+    uintptr_t payload = (uintptr_t)this->payload(dst);
+    if ((payload & mask) == 0) {
+        return dst;
+    }
+    uintptr_t aligned = (payload + MIN_BLOCK + mask) & ~mask;
+    return dst + (aligned - payload);
+}
+
+size_t Allocator::AllocatorImpl::allocAlignedBlock(
+    size_t size, uint32_t align_log2
+)
+{
+    // The worst case padding is a minimal free block and the alignment
+    size_t alignment = (size_t)1 << align_log2;
+    if (size > MAX_BLOCK - MIN_BLOCK - alignment) {
+        return NIL;
+    }
+    size_t off = this->findFree(size + MIN_BLOCK + alignment);
+    if (off == NIL) {
+        return NIL;
+    }
+
+    this->removeFree(off);
+    size_t total = this->blockSize(off);
+    size_t block = this->alignedPlace(off, align_log2);
+
+    this->setTags(block, total - (block - off), false);
+    this->header(block)->align_log2 = align_log2;
+    this->splitBlock(block, size);
+
+    // The padding is returned to the free space
+    if (block > off) {
+        this->setTags(off, block - off, true);
+        this->insertFree(off);
+    }
+    return block;
+}
+
+void Allocator::AllocatorImpl::freeBlock(size_t off)
+{
+    this->poisonBlock(off);
+    this->setTags(off, this->blockSize(off), true);
+    this->insertFree(this->UniteFreeSpace(off));
+}
+
+#ifdef ALLOCATOR_CHECKED
+/** Reports the damaged arena. */
+static AllocError corruption(const char *what, size_t off)
+{
+    std::ostringstream message;
+    message << what << " at the block offset " << off;
+    return AllocError(AllocErrorType::CorruptedArena, message.str());
+}
+
+void Allocator::AllocatorImpl::stampRedzone(size_t off, size_t N)
+{
+    unsigned char* area = static_cast<unsigned char*>(this->payload(off));
+    size_t capacity = this->blockSize(off) - BLOCK_OVERHEAD;
+    memset(area + N, REDZONE_BYTE, capacity - N - sizeof(size_t));
+    memcpy(area + capacity - sizeof(size_t), &N, sizeof(size_t));
+}
+
+void Allocator::AllocatorImpl::checkRedzone(size_t off) const
+{
+    const unsigned char* area = static_cast<unsigned char*>(
+        this->payload(off)
+    );
+    size_t capacity = this->blockSize(off) - BLOCK_OVERHEAD;
+    size_t N;
+    memcpy(&N, area + capacity - sizeof(size_t), sizeof(size_t));
+    if (N > capacity - REDZONE) {
+        throw corruption("The redzone size record is damaged", off);
+    }
+    for (size_t i = N; i < capacity - sizeof(size_t); i++) {
+        if (area[i] != REDZONE_BYTE) {
+            throw corruption("The memory area is overrun", off);
+        }
+    }
+}
+
+void Allocator::AllocatorImpl::poisonArea(size_t off)
+{
+    unsigned char* area = static_cast<unsigned char*>(this->payload(off));
+    size_t capacity = this->blockSize(off) - BLOCK_OVERHEAD;
+    size_t N;
+    memcpy(&N, area + capacity - sizeof(size_t), sizeof(size_t));
+    memset(area, FREED_BYTE, N);
+}
+#endif
+
+void Allocator::AllocatorImpl::verify() const
+{
+    size_t freeBlocks = 0;
+    size_t freeBytes = 0;
+    size_t largestFree = 0;
+    bool prevFree = false;
+
+    size_t off = 0;
+    while (off < this->size) {
+        size_t size = this->blockSize(off);
+        std::ostringstream where;
+        where << " at the block offset " << off;
+
+        if (
+            (size < MIN_BLOCK) || (size % GRANULE != 0) ||
+            (size > this->size - off)
+        ) {
+            throw AllocError(
+                AllocErrorType::CorruptedArena,
+                "The block size is damaged" + where.str()
+            );
+        }
+        size_t footer = reinterpret_cast<const BlockFooter*>(
+            this->begin + off + size - sizeof(BlockFooter)
+        )->tag;
+        if (footer != this->header(off)->tag) {
+            throw AllocError(
+                AllocErrorType::CorruptedArena,
+                "The block header and footer differ" + where.str()
+            );
+        }
+
+        if (this->isFree(off)) {
+            if (prevFree) {
+                throw AllocError(
+                    AllocErrorType::CorruptedArena,
+                    "Adjacent free blocks are not united" + where.str()
+                );
+            }
+            freeBlocks++;
+            freeBytes += size;
+            if (size > largestFree) {
+                largestFree = size;
+            }
+        } else {
+            uint32_t slot = this->header(off)->slot;
+            if (slot != NIL_SLOT) {
+                HandleSlot* entry = this->slotEntry(slot);
+                if (
+                    !entry ||
+                    (entry->offset.load(std::memory_order_relaxed) != off)
+                ) {
+                    throw AllocError(
+                        AllocErrorType::CorruptedArena,
+                        "The handle table does not refer to the block" +
+                        where.str()
+                    );
+                }
+            }
+            this->checkRedzone(off);
+        }
+        prevFree = this->isFree(off);
+        off += size;
+    }
+
+    if (
+        (freeBlocks != this->state->free_blocks) ||
+        (freeBytes != this->state->free_bytes) ||
+        (largestFree != this->largestFree())
+    ) {
+        throw AllocError(
+            AllocErrorType::CorruptedArena,
+            "The free space index does not match the arena"
+        );
+    }
+}
+
+uint32_t Allocator::AllocatorImpl::acquireSlot(size_t off)
+{
+    uint32_t slot = this->state->free_slots;
+    if (slot == NIL_SLOT) {
+        if (this->state->slot_count >= NIL_SLOT) {
+            throw AllocError(
+                AllocErrorType::NoMemory, "Handle table is exhausted"
+            );
+        }
+        slot = this->state->slot_count;
+
+        // Add the chunk when the first slot of it is used
+        size_t index = (size_t)slot + SLOT_CHUNK;
+        size_t chunk = highestBit(index) - SLOT_CHUNK_LOG2;
+        if (index == ((size_t)1 << highestBit(index))) {
+            size_t count = SLOT_CHUNK << chunk;
+            HandleSlot* entries;
+            if (this->in_arena) {
+                // The chunk is a pinned block of the arena itself
+                size_t off = this->allocBlock(
+                    blockSizeFor(count * sizeof(HandleSlot))
+                );
+                if (off == NIL) {
+                    throw AllocError(
+                        AllocErrorType::NoMemory,
+                        "Unable to find any free area for the handle table"
+                    );
+                }
+                this->header(off)->slot = NIL_SLOT;
+                this->stampRedzone(off, count * sizeof(HandleSlot));
+                entries = static_cast<HandleSlot*>(this->payload(off));
+                for (size_t i = 0; i < count; i++) {
+                    new (&entries[i]) HandleSlot;
+                }
+            } else {
+                entries = new HandleSlot[count];
+            }
+            for (size_t i = 0; i < count; i++) {
+                entries[i].offset.store(NIL, std::memory_order_relaxed);
+                entries[i].generation.store(0, std::memory_order_relaxed);
+            }
+            if (this->in_arena) {
+                // Other processes find the chunk by the offset
+                __atomic_store_n(
+                    &this->state->slot_chunks[chunk],
+                    (size_t)((unsigned char*)entries - this->begin) -
+                    sizeof(BlockHeader),
+                    __ATOMIC_RELEASE
+                );
+            }
+            this->slot_chunks[chunk].store(entries, std::memory_order_release);
+        }
+        this->state->slot_count++;
+    } else {
+        this->state->free_slots = this->slotEntry(slot)->next_free;
+    }
+    this->bindSlot(slot, off);
+    return slot;
+}
+
+bool Allocator::AllocatorImpl::retireSlot(const Pointer& p)
+{
+    HandleSlot* entry = this->slotEntry(p.slot);
+    if (!entry) {
+        return false;
+    }
+    uint32_t generation = p.generation;
+    if (!this->concurrent) {
+        if (entry->generation.load(std::memory_order_relaxed) != generation) {
+            return false;
+        }
+        entry->generation.store(generation + 1, std::memory_order_relaxed);
+        return true;
+    }
+    return entry->generation.compare_exchange_strong(
+        generation, generation + 1, std::memory_order_relaxed
+    );
+}
+
+void Allocator::AllocatorImpl::releaseSlot(uint32_t slot)
+{
+    HandleSlot* entry = this->slotEntry(slot);
+    entry->offset.store(NIL, std::memory_order_relaxed);
+    entry->next_free = this->state->free_slots;
+    this->state->free_slots = slot;
+}
+
+Allocator::AllocatorImpl::ThreadCache* Allocator::AllocatorImpl::threadCache()
+{
+    static thread_local ThreadCacheSet threadCaches;
+
+    for (ThreadCache* cache: threadCaches.caches) {
+        if (cache->owner.load(std::memory_order_relaxed) == this) {
+            return cache;
+        }
+    }
+
+    std::lock_guard<std::mutex> registryGuard(cacheRegistry());
+
+    // Drop caches of destroyed allocators
+    size_t kept = 0;
+    for (ThreadCache* cache: threadCaches.caches) {
+        if (cache->owner.load(std::memory_order_relaxed)) {
+            threadCaches.caches[kept++] = cache;
+        } else {
+            delete cache;
+        }
+    }
+    threadCaches.caches.resize(kept);
+
+    ThreadCache* cache = new ThreadCache;
+    cache->owner.store(this, std::memory_order_relaxed);
+    cache->in_use.store(false, std::memory_order_relaxed);
+    for (size_t i = 0; i < CACHE_CLASSES; i++) {
+        cache->count[i] = 0;
+    }
+    threadCaches.caches.push_back(cache);
+    {
+        // defrag walks the caches under the lock only
+        std::lock_guard<AllocatorLock> guard(this->lock);
+        this->caches.push_back(cache);
+    }
+    return cache;
+}
+
+Allocator::AllocatorImpl::ThreadCacheSet::~ThreadCacheSet()
+{
+    std::lock_guard<std::mutex> registryGuard(cacheRegistry());
+
+    for (ThreadCache* cache: this->caches) {
+        AllocatorImpl* owner = cache->owner.load(std::memory_order_relaxed);
+        if (owner) {
+            std::lock_guard<AllocatorLock> guard(owner->lock);
+            owner->flushCache(cache);
+            for (size_t i = 0; i < owner->caches.size(); i++) {
+                if (owner->caches[i] == cache) {
+                    owner->caches.erase(owner->caches.begin() + i);
+                    break;
+                }
+            }
+        }
+        delete cache;
+    }
+}
+
+void Allocator::AllocatorImpl::flushCache(
+    ThreadCache* cache, size_t cls, size_t keep
+)
+{
+    while (cache->count[cls] > keep) {
+        uint32_t slot = cache->slots[cls][--cache->count[cls]];
+        size_t off = this->slotOffset(slot);
+        this->releaseSlot(slot);
+        this->freeBlock(off);
+    }
+}
+
+void Allocator::AllocatorImpl::flushCache(ThreadCache* cache)
+{
+    for (size_t cls = 0; cls < CACHE_CLASSES; cls++) {
+        this->flushCache(cache, cls, 0);
+    }
+}
+
+bool Allocator::AllocatorImpl::enterCache(ThreadCache* cache)
+{
+    // Either defrag sees the cache in use and waits, or the cache sees
+    // defrag moving blocks and takes the lock
+    cache->in_use.store(true, std::memory_order_seq_cst);
+    if (this->moving.load(std::memory_order_seq_cst)) {
+        cache->in_use.store(false, std::memory_order_release);
+        return false;
+    }
+    return true;
+}
+
+void Allocator::AllocatorImpl::leaveCache(ThreadCache* cache)
+{
+    cache->in_use.store(false, std::memory_order_release);
+}
+
+void Allocator::AllocatorImpl::stopCaches()
+{
+    this->moving.store(true, std::memory_order_seq_cst);
+    for (ThreadCache* cache: this->caches) {
+        while (cache->in_use.load(std::memory_order_seq_cst)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+bool Allocator::AllocatorImpl::cacheBlock(
+    ThreadCache* cache, uint32_t slot, bool flush
+)
+{
+    size_t off = this->slotOffset(slot);
+    size_t size = this->blockSize(off);
+    if ((size > CACHE_MAX_BLOCK) || (this->header(off)->align_log2 != 0)) {
+        return false;
+    }
+
+    size_t cls = size / GRANULE;
+    if (cache->count[cls] == CACHE_DEPTH) {
+        if (!flush) {
+            return false;
+        }
+        this->flushCache(cache, cls, CACHE_DEPTH / 2);
+    }
+    this->poisonArea(off);
+    cache->slots[cls][cache->count[cls]++] = slot;
+    return true;
+}
+
+/** Pre-defined. Obtains the plain pointer to the memory area.
+  * @return Plain pointer to the memory area.
+  */
+void* Pointer::get() const
+{
+    if (this->allocator) {
+        Allocator::AllocatorImpl* a = this->allocator->impl;
+        if (a->isLive(*this)) {
+            return a->payload(a->slotOffset(this->slot));
+        }
+    }
+    return nullptr;
+}
+
+/** Pre-defined. Allocator constructor. */
+Allocator::Allocator(
+    void *base, size_t size, AllocatorMode mode, AllocatorStorage storage
+):
+    impl(new AllocatorImpl)
+{
+    // Blocks start at the GRANULE boundary and occupy whole granules
+    uintptr_t first = ((uintptr_t)base + GRANULE - 1) & ~(GRANULE - 1);
+    uintptr_t last = ((uintptr_t)base + size) & ~(GRANULE - 1);
+
+    // The in-arena state goes before the blocks. The shared arena keeps
+    // the state inside as other processes use it.
+    bool shared = (mode == AllocatorMode::Shared);
+    this->impl->in_arena = shared || (storage == AllocatorStorage::Arena);
+    this->impl->state = &this->impl->local_state;
+    if (this->impl->in_arena) {
+        this->impl->state = reinterpret_cast<ArenaState*>(first);
+        first += (sizeof(ArenaState) + GRANULE - 1) & ~(GRANULE - 1);
+    }
+
+    this->impl->begin = reinterpret_cast<unsigned char*>(first);
+    this->impl->size = (last > first) ? last - first : 0;
+    if (this->impl->size > MAX_BLOCK) {
+        this->impl->size = MAX_BLOCK;
+    }
+    if (this->impl->size < MIN_BLOCK) {
+        this->impl->size = 0;
+    }
+
+    this->impl->concurrent = shared || (mode == AllocatorMode::Concurrent);
+    this->impl->caching = this->impl->concurrent && !this->impl->in_arena;
+    this->impl->moving.store(false, std::memory_order_relaxed);
+    for (size_t i = 0; i < SLOT_CHUNKS; i++) {
+        this->impl->slot_chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    this->impl->alloc_count.store(0, std::memory_order_relaxed);
+    this->impl->free_count.store(0, std::memory_order_relaxed);
+    this->impl->realloc_count.store(0, std::memory_order_relaxed);
+    for (size_t i = 0; i < SIZE_HISTOGRAM; i++) {
+        this->impl->size_histogram[i].store(0, std::memory_order_relaxed);
+    }
+
+    if (this->impl->in_arena && (last < first)) {
+        delete this->impl;
+        throw AllocError(
+            AllocErrorType::InvalidArena,
+            "The arena is too small to keep the allocator state"
+        );
+    }
+    ArenaState* state = this->impl->state;
+    if (shared) {
+        this->impl->lock.shared = &state->shared_lock;
+    }
+
+    // Reattach to the state left in the arena. Handle table chunks are
+    // resolved on the first use.
+    if (
+        this->impl->in_arena &&
+        (__atomic_load_n(&state->magic, __ATOMIC_ACQUIRE) == ARENA_MAGIC)
+    ) {
+        if (
+            (state->version != ARENA_VERSION) ||
+            (state->shared != (shared ? 1 : 0)) ||
+            (state->size != this->impl->size)
+        ) {
+            delete this->impl;
+            throw AllocError(
+                AllocErrorType::InvalidArena,
+                "The arena state does not match the arena"
+            );
+        }
+        return;
+    }
+
+    state->version = ARENA_VERSION;
+    state->shared = shared ? 1 : 0;
+    state->size = this->impl->size;
+    if (shared) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&state->shared_lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+    this->impl->clearFreeLists();
+    state->defrag_cursor = 0;
+    for (size_t i = 0; i < SLOT_CHUNKS; i++) {
+        state->slot_chunks[i] = NIL;
+    }
+    state->slot_count = 0;
+    state->free_slots = NIL_SLOT;
+    state->root_slot = NIL_SLOT;
+    state->root_generation = 0;
+
+    // Consider all the specified memory as free
+    if (this->impl->size > 0) {
+        this->impl->setTags(0, this->impl->size, true);
+        this->impl->insertFree(0);
+    }
+
+    // The state is valid from now on
+    __atomic_store_n(&state->magic, ARENA_MAGIC, __ATOMIC_RELEASE);
+}
+
+/** Allocator destructor. Deallocates Allocator implementation strucuture. */
+Allocator::~Allocator()
+{
+    // Caches of the threads are deleted on the threads exit
+    {
+        std::lock_guard<std::mutex> registryGuard(cacheRegistry());
+        for (AllocatorImpl::ThreadCache* cache: this->impl->caches) {
+            cache->owner.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    // Chunks of the in-arena handle table stay with the arena
+    if (!this->impl->in_arena) {
+        for (size_t i = 0; i < SLOT_CHUNKS; i++) {
+            delete[] this->impl->slot_chunks[i].load(std::memory_order_relaxed);
+        }
+    }
+    delete this->impl;
+}
+
+size_t Allocator::block_overhead()
+{
+    return BLOCK_OVERHEAD;
+}
+
+size_t Allocator::block_size(size_t N)
+{
+    return blockSizeFor(N);
+}
+
+/** Pre-defined. Allocates the memory area with the specified size. */
+Pointer Allocator::alloc(size_t N)
+{
+
+    // Invalid zero-size memory allocation.
+    if (N == 0) {
+        return Pointer();
+    }
+
+    size_t size = (N < MAX_BLOCK) ? blockSizeFor(N) : MAX_BLOCK;
+
+    // Small blocks are taken from the thread cache first
+    AllocatorImpl::ThreadCache* cache = nullptr;
+    size_t cls = size / GRANULE;
+    if (this->impl->caching) {
+        cache = this->impl->threadCache();
+        if (
+            (size <= CACHE_MAX_BLOCK) && (cache->count[cls] > 0) &&
+            this->impl->enterCache(cache)
+        ) {
+            uint32_t slot = cache->slots[cls][--cache->count[cls]];
+            this->impl->stampRedzone(this->impl->slotOffset(slot), N);
+            this->impl->leaveCache(cache);
+            this->impl->countAlloc(N);
+            return Pointer(this, slot, this->impl->slotGeneration(slot));
+        }
+    }
+
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
+
+    // The cached block is taken under the lock while defrag is running
+    if (cache && (size <= CACHE_MAX_BLOCK) && (cache->count[cls] > 0)) {
+        uint32_t slot = cache->slots[cls][--cache->count[cls]];
+        this->impl->stampRedzone(this->impl->slotOffset(slot), N);
+        this->impl->countAlloc(N);
+        return Pointer(this, slot, this->impl->slotGeneration(slot));
+    }
+
+    // Find the free block of the proper size class
+    size_t bestFreeArea = this->impl->allocBlock(size);
+    if ((bestFreeArea == NIL) && cache) {
+        // Blocks kept by the cache of the thread may unite into a fit one
+        this->impl->flushCache(cache);
+        bestFreeArea = this->impl->allocBlock(size);
+    }
+
+    if (bestFreeArea == NIL) {
+        // Free area is not found
+        AllocError error(AllocErrorType::NoMemory, "Unable to find any free "
+        "area to allocate memory");
+        throw error;
+    }
+
+    uint32_t slot;
+    try {
+        slot = this->impl->acquireSlot(bestFreeArea);
+    } catch (AllocError &) {
+        this->impl->freeBlock(bestFreeArea);
+        throw;
+    }
+    this->impl->stampRedzone(bestFreeArea, N);
+
+    // Fill the empty cache class with a batch of blocks
+    if (cache && (size <= CACHE_MAX_BLOCK)) {
+        while (cache->count[cls] < CACHE_BATCH - 1) {
+            size_t off = this->impl->allocBlock(size);
+            if (off == NIL) {
+                break;
+            }
+            try {
+                cache->slots[cls][cache->count[cls]] =
+                    this->impl->acquireSlot(off);
+            } catch (AllocError &) {
+                this->impl->freeBlock(off);
+                break;
+            }
+            this->impl->stampRedzone(off, N);
+            cache->count[cls]++;
+        }
+    }
+
+    this->impl->countAlloc(N);
+    return Pointer(this, slot, this->impl->slotGeneration(slot));
+}
+
+Pointer Allocator::alloc_aligned(size_t N, size_t alignment)
+{
+    if ((alignment == 0) || (alignment & (alignment - 1))) {
+        throw AllocError(
+            AllocErrorType::InvalidAlignment,
+            "The alignment is not a power of two"
+        );
+    }
+
+    // Every block is aligned to GRANULE anyway
+    if (alignment <= GRANULE) {
+        return this->alloc(N);
+    }
+
+    // Invalid zero-size memory allocation.
+    if (N == 0) {
+        return Pointer();
+    }
+
+    size_t size = (N < MAX_BLOCK) ? blockSizeFor(N) : MAX_BLOCK;
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
 
-    /** Pointer implementation constructor. */
-    PointerImpl():
-        allocator(nullptr) { }
-};
+    size_t off = this->impl->allocAlignedBlock(size, highestBit(alignment));
+    if (off == NIL) {
+        throw AllocError(AllocErrorType::NoMemory, "Unable to find any free "
+        "area to allocate aligned memory");
+    }
 
-/** Pointer constructor. Allocates implementation structure. */
-Pointer::Pointer():
-    impl(new PointerImpl) { }
+    uint32_t slot;
+    try {
+        slot = this->impl->acquireSlot(off);
+    } catch (AllocError &) {
+        this->impl->freeBlock(off);
+        throw;
+    }
+    this->impl->stampRedzone(off, N);
 
-/** Copy constructor for the pointer. Necessary to return a pointer from a
-  * structure.
-  */
-Pointer::Pointer(const Pointer &p):
-    impl(new PointerImpl)
-{
-    *this = p;
+    this->impl->countAlloc(N);
+    return Pointer(this, slot, this->impl->slotGeneration(slot));
 }
 
-/** Pointer destuctor. Deallocates the pointer implementation. */
-Pointer::~Pointer()
+void *Allocator::alloc_pinned(size_t N)
 {
-    // Reset reference iterator
-    this->impl->p = std::list<MemoryInfo>::iterator();
+    // Invalid zero-size memory allocation.
+    if (N == 0) {
+        return nullptr;
+    }
 
-    delete this->impl;
-}
+    size_t size = (N < MAX_BLOCK) ? blockSizeFor(N) : MAX_BLOCK;
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
 
-/** Assignment operator for the pointer. */
-Pointer& Pointer::operator=(const Pointer& p)
-{
-    this->impl->p = p.impl->p;
-    this->impl->allocator = p.impl->allocator;
+    size_t off = this->impl->allocBlock(size);
+    if (off == NIL) {
+        throw AllocError(AllocErrorType::NoMemory, "Unable to find any free "
+        "area to allocate pinned memory");
+    }
 
-    return *this;
+    this->impl->header(off)->slot = NIL_SLOT;
+    this->impl->stampRedzone(off, N);
+    this->impl->countAlloc(N);
+    return this->impl->payload(off);
 }
 
-/** Pre-defined. Obtains the plain pointer to the memory area.
-  * @return Plain pointer to the memory area.
-  */
-void* Pointer::get() const
+void Allocator::free_pinned(void *p)
 {
-    if (this->impl->allocator) {
-        return this->impl->p->pointer;
-    } else {
-        return nullptr;
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
+
+    // Simple checks, the block must be allocated and pinned
+    unsigned char *block = reinterpret_cast<unsigned char*>(p) -
+        sizeof(BlockHeader);
+    size_t off = block - this->impl->begin;
+    if (
+        (block < this->impl->begin) || (off >= this->impl->size) ||
+        (off % GRANULE != 0) || this->impl->isFree(off) ||
+        (this->impl->header(off)->slot != NIL_SLOT)
+    ) {
+        throw AllocError(
+            AllocErrorType::InvalidFree,
+            "Unable to free. The address is not a pinned memory area of the "
+            "allocator."
+        );
     }
+
+    this->impl->checkRedzone(off);
+    this->impl->free_count.fetch_add(1, std::memory_order_relaxed);
+    this->impl->freeBlock(off);
 }
 
-/**
-  * @brief The Allocator implementation structure.
-  */
-struct Allocator::AllocatorImpl
+void Allocator::realloc(Pointer &p, size_t N)
 {
-    /** Memory areas list */
-    std::list<MemoryInfo> memory_table;
-    /** Unites consecutive free memory areas into one free memory area.
-      * @arg fs Iterator to one of consecutive free memory areas.
-      * @return Iterator for a united area if success. Invalid iterator if
-      * non-free memory area specified.
-      */
-    std::list<MemoryInfo>::iterator UniteFreeSpace(
-        std::list<MemoryInfo>::iterator fs
-    );
+    // Check whenever pointer is valid
+    if (p.allocator) {
+        if (p.allocator != this) {
+            throw AllocError(
+                AllocErrorType::InvalidFree,
+                "The pointer is created by the different allicator"
+            );
+        } else if (!this->impl->isLive(p)) {
+            throw AllocError(
+                AllocErrorType::InvalidFree,
+                "The pointer refers to a freed memory area"
+            );
+        }
+    }
 
-    /** Swaps the allocated memory area with the previous free memory area.
-      * @arg alloc_mem - allocated memory area reference iterator.
-      * @return True if successful. False if nothing has been done.
-      */
-    bool moveToPreviousFree(std::list<MemoryInfo>::iterator alloc_mem);
+    // Check whenever size is valid
+    if (N == 0) {
+        if (!p.get()) {
+            return;
+        }
+        this->free(p);
+        this->impl->countRealloc();
+        return;
+    }
 
-    /** Extends the allocated memory area to the next free memory area.
-      * @arg alloc_mem - allocated memory area reference iterator.
-      * @arg new_size - new size of extended memory area.
-      * @return True if successful. False if nothing has been done.
-      */
-    bool extendToNextFree(
-        std::list<MemoryInfo>::iterator alloc_mem, size_t new_size
+    // Just allocate for null pointer
+    if (!p.get()) {
+        p = this->alloc(N);
+        this->impl->countRealloc();
+        return;
+    }
+
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
+
+    size_t off = this->impl->slotOffset(p.slot);
+    size_t blockSize = this->impl->blockSize(off);
+    size_t size = (N < MAX_BLOCK) ? blockSizeFor(N) : MAX_BLOCK;
+    this->impl->checkRedzone(off);
+
+    // Try the quick realloc
+    if (size <= blockSize) {
+        // Return the tail to the free space, it joins the next free block
+        this->impl->splitBlock(off, size);
+        this->impl->stampRedzone(off, N);
+        this->impl->countRealloc();
+        return;
+    }
+
+    // Inplace reallocation without copying
+    if (this->impl->extendToNextFree(off, size)) {
+        this->impl->stampRedzone(off, N);
+        this->impl->countRealloc();
+        return;
+    }
+
+    // Grow backwards and forwards at once, only the content is copied
+    if (this->impl->extendToNeighbours(off, size)) {
+        this->impl->stampRedzone(this->impl->slotOffset(p.slot), N);
+        this->impl->countRealloc();
+        return;
+    }
+
+    // All the simple reallocations failed, the alignment is kept
+    uint32_t align_log2 = this->impl->header(off)->align_log2;
+    size_t newOff = (align_log2 == 0) ?
+        this->impl->allocBlock(size) :
+        this->impl->allocAlignedBlock(size, align_log2);
+    if (newOff == NIL) {
+        throw AllocError(AllocErrorType::NoMemory, "Unable to find any free "
+        "area to allocate memory");
+    }
+    memcpy(
+        this->impl->payload(newOff), this->impl->payload(off),
+        blockSize - BLOCK_OVERHEAD
     );
-};
 
-/** Calculates memory amount of the consecutive memory areas range
-  * [first, last).
-  * @arg first - first memory area reference iterator.
-  * @arg last - the memory after the last area in the range.
-  * @return Memory amount in the range.
-  */
-size_t rangeMemoryAmount(
-    std::list<MemoryInfo>::iterator first,
-    std::list<MemoryInfo>::iterator last
-)
+    // Keep the slot of the pointer, so all its copies remain valid
+    this->impl->bindSlot(p.slot, newOff);
+    this->impl->stampRedzone(newOff, N);
+    this->impl->freeBlock(off);
+    this->impl->countRealloc();
+}
+
+void Allocator::free(Pointer &p)
 {
-    std::list<MemoryInfo>::iterator current;
-    size_t returnValue = 0;
+    // Simple checks. Stale copies of a freed pointer are caught by the
+    // slot generation.
+    if ((p.allocator != this) || !this->impl->retireSlot(p)) {
+        throw AllocError(
+            AllocErrorType::InvalidFree,
+            "Unable to free. The pointer is invalid or created by the "
+            "different allocator."
+        );
+    }
 
-    for (current = first; current != last; ++current) {
-        returnValue += current->size;
+    uint32_t slot = p.slot;
+
+    // Small blocks are kept by the thread cache. The block is read only
+    // when defrag cannot move it.
+    AllocatorImpl::ThreadCache* cache = nullptr;
+    if (this->impl->caching) {
+        cache = this->impl->threadCache();
+        if (this->impl->enterCache(cache)) {
+            bool cached;
+            try {
+                // The damaged block is never reused
+                this->impl->checkRedzone(this->impl->slotOffset(slot));
+                cached = this->impl->cacheBlock(cache, slot, false);
+            } catch (AllocError &) {
+                this->impl->leaveCache(cache);
+                throw;
+            }
+            this->impl->leaveCache(cache);
+            if (cached) {
+                this->impl->free_count.fetch_add(1, std::memory_order_relaxed);
+                p = Pointer();
+                return;
+            }
+        }
     }
 
-    return returnValue;
-}
+    // The offset is resolved under the lock, defrag may move the block
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
+    size_t off = this->impl->slotOffset(slot);
+    this->impl->checkRedzone(off);
+    this->impl->free_count.fetch_add(1, std::memory_order_relaxed);
 
+    // Make the pointer invalid
+    p = Pointer();
 
-bool Allocator::AllocatorImpl::moveToPreviousFree(
-    std::list<MemoryInfo>::iterator alloc_mem
-)
+    if (!cache || !this->impl->cacheBlock(cache, slot, true)) {
+        this->impl->releaseSlot(slot);
+        this->impl->freeBlock(off);
+    }
+}
+
+void Allocator::alloc_batch(size_t n, size_t N, Pointer* out)
 {
-    // Simple checks
-    if (alloc_mem == this->memory_table.begin()) {
-        return false;
-    } else if (alloc_mem == memory_table.end()) {
-        return false;
-    } else if (alloc_mem->is_freespace) {
-        return false;
+    if ((n == 0) || (N == 0)) {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = Pointer();
+        }
+        return;
     }
 
-    // Obtain the previous memory area
-    auto previousArea = alloc_mem;
-    --previousArea;
-    if (previousArea->is_freespace) {
-        if (previousArea->size >= alloc_mem->size) {
-            memcpy(previousArea->pointer, alloc_mem->pointer, alloc_mem->size);
+    size_t size = (N < MAX_BLOCK) ? blockSizeFor(N) : MAX_BLOCK;
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
+
+    // Carve the whole batch from one free block when possible
+    size_t first = NIL;
+    size_t total = 0;
+    if (size <= MAX_BLOCK / n) {
+        first = this->impl->allocBlock(size * n);
+    }
+    if (first != NIL) {
+        total = this->impl->blockSize(first);
+    }
+
+    size_t allocated = 0;
+    try {
+        if (first != NIL) {
+            size_t off = first;
+            for (; allocated < n; allocated++) {
+                // The last block takes the rest which is too small to split
+                size_t blockSize = (allocated + 1 < n) ?
+                    size : total - (off - first);
+                this->impl->setTags(off, blockSize, false);
+                this->impl->header(off)->align_log2 = 0;
+                uint32_t slot = this->impl->acquireSlot(off);
+                out[allocated] = Pointer(
+                    this, slot, this->impl->slotGeneration(slot)
+                );
+                off += blockSize;
+            }
         } else {
-            // Avoid destination and source areas crossing
-            size_t remainingBytes = alloc_mem->size;
-            size_t offset = 0;
-            while (remainingBytes > 0){
-                // Determine bytes to copy
-                size_t bytesToCopy = previousArea->size;
-                if (bytesToCopy > remainingBytes) {
-                    bytesToCopy = remainingBytes;
+            for (; allocated < n; allocated++) {
+                size_t off = this->impl->allocBlock(size);
+                if (off == NIL) {
+                    throw AllocError(AllocErrorType::NoMemory, "Unable to "
+                    "find free space for the whole batch");
                 }
-                // Copy memory content
-                memcpy(
-                    (void*)((unsigned char*)(previousArea->pointer) + offset),
-                    (void*)((unsigned char*)(alloc_mem->pointer) + offset),
-                    bytesToCopy
+                uint32_t slot;
+                try {
+                    slot = this->impl->acquireSlot(off);
+                } catch (AllocError &) {
+                    this->impl->freeBlock(off);
+                    throw;
+                }
+                out[allocated] = Pointer(
+                    this, slot, this->impl->slotGeneration(slot)
                 );
-                offset += bytesToCopy;
-                remainingBytes -= bytesToCopy;
             }
         }
-        // Swap allocated and free memory
-        MemoryInfo newFreeArea(
-            (void*)((unsigned char*)(previousArea->pointer) + alloc_mem->size),
-            previousArea->size, true
-        );
-        alloc_mem->pointer = previousArea->pointer;
-        this->memory_table.erase(previousArea);
-        auto nextArea = alloc_mem;
-        ++nextArea;
-        this->memory_table.insert(nextArea, newFreeArea);
-        return true;
-    } else {
-        return false;
+    } catch (AllocError &) {
+        // Nothing is allocated if the batch fails
+        for (size_t i = 0; i < allocated; i++) {
+            this->impl->retireSlot(out[i]);
+            size_t off = this->impl->slotOffset(out[i].slot);
+            this->impl->releaseSlot(out[i].slot);
+            if (first == NIL) {
+                this->impl->freeBlock(off);
+            }
+            out[i] = Pointer();
+        }
+        if (first != NIL) {
+            this->impl->setTags(first, total, false);
+            this->impl->freeBlock(first);
+        }
+        throw;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        this->impl->stampRedzone(this->impl->slotOffset(out[i].slot), N);
+        this->impl->countAlloc(N);
     }
 }
 
-bool Allocator::AllocatorImpl::extendToNextFree(
-    std::list<MemoryInfo>::iterator alloc_mem,
-    size_t new_size
-)
+void Allocator::free_batch(Pointer* ptrs, size_t n)
 {
-    // Simple checks
-    if (alloc_mem == memory_table.end()) {
-        return false;
-    } else if (alloc_mem->is_freespace) {
-        return false;
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
+
+    // Retire all the pointers first, the invalid ones are skipped
+    std::vector<size_t> offsets;
+    offsets.reserve(n);
+    bool invalid = false;
+#ifdef ALLOCATOR_CHECKED
+    // Nothing is freed if any of the areas is damaged
+    for (size_t i = 0; i < n; i++) {
+        if ((ptrs[i].allocator == this) && this->impl->isLive(ptrs[i])) {
+            this->impl->checkRedzone(this->impl->slotOffset(ptrs[i].slot));
+        }
+    }
+#endif
+    for (size_t i = 0; i < n; i++) {
+        if ((ptrs[i].allocator != this) || !this->impl->retireSlot(ptrs[i])) {
+            invalid = true;
+            continue;
+        }
+        size_t off = this->impl->slotOffset(ptrs[i].slot);
+        this->impl->releaseSlot(ptrs[i].slot);
+        offsets.push_back(off);
+        ptrs[i] = Pointer();
     }
+    this->impl->free_count.fetch_add(
+        offsets.size(), std::memory_order_relaxed
+    );
 
-    auto nextArea = alloc_mem;
-    ++nextArea;
-    if (nextArea == this->memory_table.end()) {
-        return false;
-    } else if (!nextArea->is_freespace) {
-        return false;
-    // Check if there is enough size to extend
-    } else if (nextArea->size < new_size - alloc_mem->size) {
-        return false;
+    // Adjacent blocks are united before they are indexed
+    std::sort(offsets.begin(), offsets.end());
+    size_t i = 0;
+    while (i < offsets.size()) {
+        size_t first = offsets[i];
+        size_t end = first + this->impl->blockSize(first);
+        for (i++; (i < offsets.size()) && (offsets[i] == end); i++) {
+            end += this->impl->blockSize(end);
+        }
+        this->impl->setTags(first, end - first, true);
+        this->impl->poisonBlock(first);
+        this->impl->insertFree(this->impl->UniteFreeSpace(first));
     }
 
-    // Extend the area
-    nextArea->pointer = (void*)(
-        (unsigned char*)(nextArea->pointer) + new_size - alloc_mem->size
-    );
-    nextArea->size -= new_size - alloc_mem->size;
-    alloc_mem->size = new_size;
-    if (nextArea->size == 0) {
-        this->memory_table.erase(nextArea);
+    if (invalid) {
+        throw AllocError(
+            AllocErrorType::InvalidFree,
+            "Unable to free. Some of the pointers are invalid or created by "
+            "the different allocator."
+        );
     }
-    return true;
 }
 
-std::list<MemoryInfo>::iterator Allocator::AllocatorImpl::UniteFreeSpace(
-    std::list<MemoryInfo>::iterator fs
-)
+void Allocator::defrag()
 {
-    std::list<MemoryInfo>::iterator highestArea, lowestArea, currentArea;
-    size_t cumulativeSize = 0;
-
-    if (fs == this->memory_table.end()) {
-        return std::list<MemoryInfo>::iterator();
+    AllocatorImpl::ThreadCache* cache = nullptr;
+    if (this->impl->caching) {
+        cache = this->impl->threadCache();
     }
 
-    if (!fs->is_freespace) {
-        return std::list<MemoryInfo>::iterator();
-    }
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
 
-    // Find the highest (with least address) free memory area of the set
-    highestArea = fs;
-    while (highestArea != this->memory_table.begin()) {
-        currentArea = highestArea;
-        --currentArea;
-        if (currentArea->is_freespace) {
-            --highestArea;
-        } else {
-            break;
-        }
+    // Free space kept by the cache of the thread is compacted too
+    if (cache) {
+        this->impl->flushCache(cache);
     }
+#ifdef ALLOCATOR_CHECKED
+    this->impl->verify();
+#endif
+    this->impl->stopCaches();
 
-    /*
-     * Find the highest (with least address) allocated memory area after the
-     * set. May be end().
-     */
-    lowestArea = fs;
-    do {
-        ++lowestArea;
-        if (lowestArea == this->memory_table.end()) {
-            break;
+    // All the free space is gathered into the single block at the end
+    this->impl->clearFreeLists();
+    this->impl->state->defrag_cursor = 0;
+
+    // Slide runs of allocated blocks towards the beginning of the arena,
+    // one memmove per run
+    size_t dst = 0;
+    size_t off = 0;
+    // The block placed right before dst
+    size_t last = NIL;
+    while (off < this->impl->size) {
+        if (this->impl->isFree(off)) {
+            off += this->impl->blockSize(off);
+            continue;
         }
-    } while (lowestArea->is_freespace);
 
-    // Obtain last free memory area in the set
-    currentArea = lowestArea;
-    --currentArea;
+        // Aligned block which would lose its alignment at dst is placed
+        // after a padding, pinned block stays in place
+        if (!this->impl->movableTo(off, dst)) {
+            size_t place = this->impl->placeFor(off, dst);
+            if (place - dst >= MIN_BLOCK) {
+                this->impl->setTags(dst, place - dst, true);
+                this->impl->insertFree(dst);
+                last = dst;
+            } else {
+                // Too small to be a free block, joins the previous block.
+                // There is always one: the arena begins with blocks of at
+                // least MIN_BLOCK bytes.
+                size_t lastSize = this->impl->blockSize(last);
+                if (this->impl->isFree(last)) {
+                    this->impl->removeFree(last);
+                    this->impl->setTags(last, lastSize + place - dst, true);
+                    this->impl->insertFree(last);
+                } else {
+                    this->impl->growAllocated(last, lastSize + place - dst);
+                }
+            }
+            dst = place;
+        }
 
-    // Check if there is only one free memory area in the set
-    if (highestArea != currentArea) {
-        // Calculate the memory amount
-        cumulativeSize = rangeMemoryAmount(highestArea, lowestArea);
+        // The run ends before a block which cannot be moved with it
+        size_t first = off;
+        do {
+            last = dst + (off - first);
+            off += this->impl->blockSize(off);
+        } while (
+            (off < this->impl->size) && !this->impl->isFree(off) &&
+            this->impl->movableTo(off, dst + (off - first))
+        );
 
-        // Use the first memory area of the set
-        highestArea->size = cumulativeSize;
-        // Remove other memory areas
-        currentArea = highestArea;
-        ++currentArea;
-        this->memory_table.erase(currentArea, lowestArea);
+        if (dst != first) {
+            this->impl->relocateSlots(first, off, dst);
+            memmove(
+                this->impl->begin + dst, this->impl->begin + first,
+                off - first
+            );
+        }
+        dst += off - first;
     }
 
-    return highestArea;
+    if (dst < this->impl->size) {
+        this->impl->setTags(dst, this->impl->size - dst, true);
+        this->impl->insertFree(dst);
+    }
+    this->impl->resumeCaches();
 }
 
-/** Pre-defined. Allocator constructor. */
-Allocator::Allocator(void *base, size_t size):
-    impl(new AllocatorImpl)
+DefragReport Allocator::defrag_step(size_t byte_budget)
 {
-    // Consider all the specified memory as free
-    this->impl->memory_table.push_back(MemoryInfo(base, size, true));
-}
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
+    this->impl->stopCaches();
 
-/** Allocator destructor. Deallocates Allocator implementation strucuture. */
-Allocator::~Allocator()
-{
-    this->impl->memory_table.clear();
-    delete this->impl;
-}
+    DefragReport report;
+    report.bytes_moved = 0;
+    report.fragmentation_before = this->impl->fragmentation();
+    report.done = false;
 
-/** Pre-defined. Allocates the memory area with the specified size. */
-Pointer Allocator::alloc(size_t N)
-{
+    size_t& cursor = this->impl->state->defrag_cursor;
+    while (true) {
+        if (cursor >= this->impl->size) {
+            report.done = true;
+            break;
+        }
 
-    // Invalid pointer by default
-    Pointer returnPointer;
+        // Skip the allocated blocks which are already in place
+        if (!this->impl->isFree(cursor)) {
+            cursor += this->impl->blockSize(cursor);
+            continue;
+        }
 
-    // Invalid zero-size memory allocation.
-    if (N == 0) {
-        return returnPointer;
-    }
+        // The free block is followed by an allocated one or ends the arena
+        size_t next = cursor + this->impl->blockSize(cursor);
+        if (next >= this->impl->size) {
+            report.done = true;
+            break;
+        }
 
-    // Find the free area with the best proper size
-    bool bestIsSet = false;
-    size_t minAmountDifference = 0;
-    std::list<MemoryInfo>::iterator bestFreeArea;
+        // Aligned block is placed after a padding, pinned block stays in
+        // place
+        size_t dst = cursor;
+        if (!this->impl->movableTo(next, cursor)) {
+            dst = this->impl->placeFor(next, cursor);
+            if (dst >= next) {
+                // The free block is the padding, the block stays in place
+                cursor = next + this->impl->blockSize(next);
+                continue;
+            }
+        }
 
-    for (
-        auto currentArea = this->impl->memory_table.begin();
-        currentArea != this->impl->memory_table.end();
-        ++currentArea
-    ) {
-        if ((currentArea->is_freespace) && (currentArea->size >= N)) {
+        // Take the run of allocated blocks fitting the budget. At least one
+        // block is moved per slice to make progress. The run ends before a
+        // block which cannot be moved with it.
+        size_t end = next;
+        bool exhausted = false;
+        while (
+            (end < this->impl->size) && !this->impl->isFree(end) &&
+            this->impl->movableTo(end, dst + (end - next))
+        ) {
+            size_t size = this->impl->blockSize(end);
             if (
-                (!bestIsSet) ||
-                (minAmountDifference > currentArea->size - N)
+                ((report.bytes_moved > 0) || (end > next)) &&
+                (report.bytes_moved + (end - next) + size > byte_budget)
             ) {
-                minAmountDifference = currentArea->size - N;
-                bestFreeArea = currentArea;
-                bestIsSet = true;
+                exhausted = true;
+                break;
             }
+            end += size;
+        }
+        if (end == next) {
+            break;
         }
-    }
 
-    if (!bestIsSet) {
-        // Free area is not found
-        AllocError error(AllocErrorType::NoMemory, "Unable to find any free "
-        "area to allocate memory");
-        throw error;
-    }
+        report.bytes_moved += end - next;
+        cursor = this->impl->moveToPreviousFree(next, end, dst - cursor);
 
-    // Try to change the free area to an allocated area
-    if (bestFreeArea->size == N) {
-        bestFreeArea->is_freespace = false;
-        returnPointer.impl->p = bestFreeArea;
-    } else {
-        // Allocate part of the free area
-        MemoryInfo allocatedInfo(bestFreeArea->pointer, N, false);
-        returnPointer.impl->p = this->impl->memory_table.insert(
-            bestFreeArea, allocatedInfo
-        );
-        // Reduce the free area
-        bestFreeArea->pointer = (void*)(
-            (unsigned char*)(bestFreeArea->pointer) + N
-        );
-        bestFreeArea->size -= N;
+        if (exhausted) {
+            break;
+        }
     }
 
+    // The next slice starts a new pass
+    if (report.done) {
+        cursor = 0;
+    }
 
-    // Make the pointer valid
-    returnPointer.impl->allocator = this;
-
-    return returnPointer;
+    report.fragmentation_after = this->impl->fragmentation();
+    this->impl->resumeCaches();
+    return report;
 }
 
-void Allocator::realloc(Pointer &p, size_t N)
+uint64_t Allocator::to_handle(const Pointer &p)
 {
-    // Check whenever pointer is valid
-    if ((p.impl->allocator) && (p.impl->allocator != this)) {
-        throw AllocError(
-            AllocErrorType::InvalidFree,
-            "The pointer is created by the different allicator"
-        );
+    if ((p.allocator != this) || !this->impl->isLive(p)) {
+        return (uint64_t)NIL_SLOT;
     }
+    return ((uint64_t)p.generation << 32) | p.slot;
+}
 
-    // Check whenever size is valid
-    if (N == 0) {
-        if (p.get()) {
-            this->free(p);
-        }
-        return;
+Pointer Allocator::from_handle(uint64_t handle)
+{
+    // Unused slots match the generation too, but refer to no block
+    Pointer p(this, (uint32_t)handle, (uint32_t)(handle >> 32));
+    if (
+        (p.slot == NIL_SLOT) || !this->impl->isLive(p) ||
+        (this->impl->slotOffset(p.slot) == NIL)
+    ) {
+        return Pointer();
     }
+    return p;
+}
 
-    // Just allocate for null pointer
-    if (!p.get()) {
-        p = this->alloc(N);
-        return;
-    }
+void Allocator::set_root(const Pointer &p)
+{
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
 
-    // Try the quick realloc
-    if (N < p.impl->p->size) {
-        // Insert a free space area after the specified one
-        MemoryInfo freeAreaInfo(
-            (void*)((unsigned char*)(p.impl->p->pointer) + N),
-            p.impl->p->size - N, true
-        );
-        auto currentArea = p.impl->p;
-        ++currentArea;
-        this->impl->memory_table.insert(currentArea, freeAreaInfo);
-        // Change specified area size
-        p.impl->p->size = N;
-        return;
-    } else if (N == p.impl->p->size) {
-        // Do nothing
-        return;
-    }
+    bool valid = (p.allocator == this) && this->impl->isLive(p);
+    this->impl->state->root_slot = valid ? p.slot : NIL_SLOT;
+    this->impl->state->root_generation = p.generation;
+}
 
-    // Inplace reallocation
-    if (this->impl->extendToNextFree(p.impl->p, N)) {
-        return;
+Pointer Allocator::root()
+{
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
+
+    Pointer p(
+        this, this->impl->state->root_slot, this->impl->state->root_generation
+    );
+    if ((p.slot == NIL_SLOT) || !this->impl->isLive(p)) {
+        return Pointer();
     }
+    return p;
+}
 
-    // Try to unite with the previous
-    if (p.impl->p != this->impl->memory_table.begin()) {
-        auto previousArea = p.impl->p;
-        --previousArea;
-        do {
-            if (previousArea->size + p.impl->p->size < N) {
-                break;
-            }
-            if (!this->impl->moveToPreviousFree(p.impl->p)) {
-                break;
+void Allocator::release_free_pages()
+{
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
+
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    for (size_t fl = 0; fl < FL_COUNT; fl++) {
+        for (size_t sl = 0; sl < SL_COUNT; sl++) {
+            for (
+                size_t off = this->impl->state->heads[fl][sl]; off != NIL;
+                off = this->impl->links(off)->next
+            ) {
+                // The header, the links and the footer must stay
+                uintptr_t first = (uintptr_t)(
+                    this->impl->begin + off + sizeof(BlockHeader) +
+                    sizeof(FreeLinks)
+                );
+                uintptr_t last = (uintptr_t)(
+                    this->impl->begin + off + this->impl->blockSize(off) -
+                    sizeof(BlockFooter)
+                );
+                first = (first + page - 1) & ~(page - 1);
+                last &= ~(page - 1);
+                if (first < last) {
+                    madvise((void*)first, last - first, MADV_DONTNEED);
+                }
             }
-            this->impl->extendToNextFree(p.impl->p, N);
-            return;
-        } while (false);
+        }
     }
+}
 
-    // All the simple reallocations failed
-    Pointer new_p = this->alloc(N);
-    memcpy(new_p.get(), p.get(), p.impl->p->size);
-    this->free(p);
-
-    p = new_p;
+void Allocator::check()
+{
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
+    this->impl->verify();
 }
-void Allocator::free(Pointer &p)
+
+size_t Allocator::usable_size(const Pointer &p)
 {
-    // Simple checks
-    if (p.impl->allocator != this) {
-        throw AllocError(
-            AllocErrorType::InvalidFree,
-            "Unable to free. The pointer is invalid or created by the "
-            "different allocator."
-        );
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
+
+    if ((p.allocator != this) || !this->impl->isLive(p)) {
+        return 0;
     }
+    size_t off = this->impl->slotOffset(p.slot);
+    size_t capacity = this->impl->blockSize(off) - BLOCK_OVERHEAD;
+#ifdef ALLOCATOR_CHECKED
+    // Bytes after the requested size belong to the redzone
+    memcpy(
+        &capacity,
+        static_cast<unsigned char*>(this->impl->payload(off)) + capacity -
+            sizeof(size_t),
+        sizeof(size_t)
+    );
+#endif
+    return capacity;
+}
 
-    // Frees the memory area
-    p.impl->p->is_freespace = true;
-    this->impl->UniteFreeSpace(p.impl->p);
+size_t Allocator::largest_free_bound()
+{
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
 
-    // Make the pointer invalid
-    p.impl->p = std::list<MemoryInfo>::iterator();
-    p.impl->allocator = nullptr;
+    // The lower bound of the highest non-empty size class
+    uint64_t fl_bitmap = this->impl->state->fl_bitmap;
+    if (fl_bitmap == 0) {
+        return 0;
+    }
+    size_t fl = highestBit(fl_bitmap);
+    size_t sl = highestBit(this->impl->state->sl_bitmap[fl]);
+    if (fl == 0) {
+        return sl << GRANULE_LOG2;
+    }
+    return (SL_COUNT + sl) << (fl + GRANULE_LOG2 - 1);
 }
 
-void Allocator::defrag()
+AllocatorStats Allocator::stats()
 {
-    /* Unite free space at the beginning (begin + 1 will be the end or
-     * allocated)
-     */
-    this->impl->UniteFreeSpace(this->impl->memory_table.begin());
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
 
-    // Bubble
-    for (
-        auto freeArea = this->impl->memory_table.begin();
-        freeArea != this->impl->memory_table.end(); ++freeArea
-    ) {
-        if (freeArea->is_freespace) {
-            // Unite free areas
-            this->impl->UniteFreeSpace(freeArea);
-            // The next area will be the end or an allocated one
-            std::list<MemoryInfo>::iterator allocatedArea = freeArea;
-            ++allocatedArea;
-
-            /* Move allocated area content to the free area content.
-             * Swap areas.
-             */
-            if (this->impl->moveToPreviousFree(allocatedArea)) {
-                freeArea = allocatedArea;
-            }
-        }
+    AllocatorStats result;
+    result.bytes_free = this->impl->state->free_bytes;
+    result.bytes_allocated = this->impl->size - this->impl->state->free_bytes;
+    result.largest_free = this->impl->largestFree();
+    result.free_blocks = this->impl->state->free_blocks;
+    result.fragmentation = this->impl->fragmentation();
+    result.allocs = this->impl->alloc_count.load(std::memory_order_relaxed);
+    result.frees = this->impl->free_count.load(std::memory_order_relaxed);
+    result.reallocs = this->impl->realloc_count.load(
+        std::memory_order_relaxed
+    );
+    for (size_t i = 0; i < SIZE_HISTOGRAM; i++) {
+        result.size_histogram[i] = this->impl->size_histogram[i].load(
+            std::memory_order_relaxed
+        );
     }
+    return result;
 }
 
 std::string Allocator::dump()
 {
+    AllocatorGuard guard(this->impl->lock, this->impl->concurrent);
+
     std::ostringstream outs;
 
     size_t freeSize = 0;
     size_t allocatedSize = 0;
 
     for (
-        auto currentArea = this->impl->memory_table.cbegin();
-        currentArea != this->impl->memory_table.cend(); ++currentArea
+        size_t off = 0; off < this->impl->size;
+        off += this->impl->blockSize(off)
     ) {
+        size_t size = this->impl->blockSize(off) - BLOCK_OVERHEAD;
         outs << "[ ";
-        if (currentArea->is_freespace) {
-            freeSize += currentArea->size;
+        if (this->impl->isFree(off)) {
+            freeSize += size;
             outs << "FREE";
         } else {
-            allocatedSize += currentArea->size;
+            allocatedSize += size;
             outs << "ALLOC";
         }
-        outs << " " << std::hex << currentArea->pointer << " " << std::dec <<
-        currentArea->size << " ]; ";
+        outs << " " << std::hex << this->impl->payload(off) << " " <<
+        std::dec << size << " ]; ";
     }
     outs << "Allocated: " << allocatedSize << "; Free: " << freeSize << ";";
     return outs.str();
@@ -1,9 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
 #include <stdexcept>
 #include <string>
+#include <utility>
 
 enum class AllocErrorType {
     InvalidFree,
     NoMemory,
+    InvalidAlignment,
+    InvalidArena,
+    CorruptedArena,
+};
+
+enum class AllocatorMode {
+    /** The allocator is used by one thread at a time. */
+    SingleThreaded,
+    /** The allocator is shared between threads. Freed small blocks are kept
+      * by per-thread caches and returned to the arena in batches.
+      */
+    Concurrent,
+    /** The arena is shared between processes, e.g. a shared memory
+      * segment mapped by each of them. The allocator state is kept in the
+      * arena and protected by a process-shared lock. Pointers are passed
+      * between processes as handles, see Allocator::to_handle.
+      */
+    Shared,
+};
+
+enum class AllocatorStorage {
+    /** The allocator state is kept in the process memory, the arena holds
+      * the blocks only.
+      */
+    Process,
+    /** The allocator state is kept at the beginning of the arena, so the
+      * arena may outlive the allocator, e.g. in a mapped file. An allocator
+      * created over the arena later reattaches to the state in O(1).
+      */
+    Arena,
 };
 
 class AllocError: std::runtime_error {
@@ -19,36 +54,216 @@ public:
     AllocErrorType getType() const { return type; }
 };
 
+/**
+  * @brief Result of an incremental defragmentation slice.
+  */
+struct DefragReport {
+    /** Bytes moved by the slice. */
+    size_t bytes_moved;
+    /** Fragmentation of the free space before and after the slice: zero when
+      * all the free space is one area, close to one when it is scattered.
+      */
+    double fragmentation_before;
+    double fragmentation_after;
+    /** Whether the slice has finished the defragmentation pass. */
+    bool done;
+};
+
+/**
+  * @brief Allocator statistics. Maintained incrementally, so obtaining them
+  * does not walk the arena.
+  */
+struct AllocatorStats {
+    /** Arena bytes taken by allocated blocks, block overhead included. */
+    size_t bytes_allocated;
+    /** Arena bytes of free blocks. */
+    size_t bytes_free;
+    /** Size of the largest free block. */
+    size_t largest_free;
+    /** Number of free blocks. */
+    size_t free_blocks;
+    /** Fragmentation of the free space: 1 - largest_free / bytes_free. */
+    double fragmentation;
+    /** Number of successful alloc, free and realloc calls. */
+    size_t allocs;
+    size_t frees;
+    size_t reallocs;
+    /** Allocations by requested size. Bucket i counts sizes in
+      * [2^i, 2^(i + 1)).
+      */
+    size_t size_histogram[64];
+};
+
 class Allocator;
 
+/**
+  * @brief Handle of a memory area. The handle refers to a slot of the
+  * allocator handle table, so copying it costs nothing and it stays valid
+  * while the allocator moves the memory area.
+  */
 class Pointer {
 
 friend class Allocator;
+friend class RegionAllocator;
 
 public:
-    Pointer();
-    Pointer(const Pointer& p);
-    ~Pointer();
-    Pointer& operator=(const Pointer& p);
+    Pointer() noexcept;
+    Pointer(const Pointer& p) = default;
+    Pointer& operator=(const Pointer& p) = default;
+
+    /** Move constructor. Leaves the source pointer invalid. */
+    Pointer(Pointer&& p) noexcept:
+        allocator(p.allocator), slot(p.slot), generation(p.generation)
+    {
+        p.allocator = nullptr;
+    }
+
+    /** Move assignment. Leaves the source pointer invalid. */
+    Pointer& operator=(Pointer&& p) noexcept {
+        if (this != &p) {
+            this->allocator = p.allocator;
+            this->slot = p.slot;
+            this->generation = p.generation;
+            p.allocator = nullptr;
+        }
+        return *this;
+    }
+
+    /** Exchanges the handles of two pointers. */
+    void swap(Pointer& p) noexcept {
+        std::swap(this->allocator, p.allocator);
+        std::swap(this->slot, p.slot);
+        std::swap(this->generation, p.generation);
+    }
 
     void *get() const;
 
 private:
-    struct PointerImpl;
-    PointerImpl* impl;
+    Pointer(Allocator* _allocator, uint32_t _slot, uint32_t _generation)
+        noexcept;
+
+    /** Allocator reference. If nullptr then the pointer is invalid. */
+    Allocator* allocator;
+    /** Handle table slot of the memory area. */
+    uint32_t slot;
+    /** Slot generation the handle has been issued for. The pointer is stale
+      * when it differs from the current slot generation.
+      */
+    uint32_t generation;
 };
 
+inline void swap(Pointer& a, Pointer& b) noexcept
+{
+    a.swap(b);
+}
+
+/**
+  * @brief Allocator of movable memory areas inside the specified arena.
+  *
+  * In the concurrent mode alloc, realloc and free may be called from any
+  * thread. defrag moves memory areas, so no other thread may use plain
+  * pointers obtained with Pointer::get() while it runs.
+  *
+  * Plain pointers must not be kept across realloc and defrag. Memory which
+  * is referred to by plain pointers, e.g. container storage obtained with
+  * ArenaAllocator, is allocated pinned and never moved.
+  */
 class Allocator {
+
+friend class Pointer;
+
 public:
-    Allocator(void *base, size_t size);
+    Allocator(
+        void *base, size_t size,
+        AllocatorMode mode = AllocatorMode::SingleThreaded,
+        AllocatorStorage storage = AllocatorStorage::Process
+    );
     ~Allocator();
-    
+
+    /** Arena bytes taken by the header and the footer of every block. */
+    static size_t block_overhead();
+    /** Arena bytes taken by an allocation of N bytes. Includes the block
+      * overhead and the rounding of the block size.
+      */
+    static size_t block_size(size_t N);
+
     Pointer alloc(size_t N);
+    /** Allocates the memory area with the address aligned to the specified
+      * power of two, e.g. a cache line or a page. The padding before the
+      * area stays free. realloc and defrag keep the alignment when they move
+      * the area.
+      */
+    Pointer alloc_aligned(size_t N, size_t alignment);
     void realloc(Pointer &p, size_t N);
     void free(Pointer &p);
 
+    /** Allocates the memory area which is never moved, e.g. a slab of
+      * objects referred to by plain pointers. defrag leaves the area in
+      * place and compacts around it.
+      */
+    void *alloc_pinned(size_t N);
+    /** Frees the memory area allocated with alloc_pinned. */
+    void free_pinned(void *p);
+
+    /** Allocates n memory areas of N bytes each. The batch is carved from
+      * one free area when there is a large enough one. Either all the
+      * areas are allocated or AllocError is thrown and nothing is.
+      */
+    void alloc_batch(size_t n, size_t N, Pointer* out);
+    /** Frees n memory areas. Adjacent areas are united once. Invalid
+      * pointers are skipped and reported with AllocError after all the
+      * valid ones are freed.
+      */
+    void free_batch(Pointer* ptrs, size_t n);
+
     void defrag();
+    /** Continues the defragmentation moving about byte_budget bytes. Slices
+      * may be interleaved with any other calls, pointers stay valid.
+      */
+    DefragReport defrag_step(size_t byte_budget);
     std::string dump();
+    /** Verifies the arena integrity: block boundary tags, the free space
+      * index and the handle table. The build with ALLOCATOR_CHECKED defined
+      * also verifies the redzones after every memory area.
+      * @throw AllocError of the CorruptedArena type if the arena is damaged.
+      */
+    void check();
+    /** Returns the whole pages inside free blocks to the OS with madvise.
+      * The block metadata stays in place.
+      */
+    void release_free_pages();
+    /** Returns the number of bytes usable in the memory area, at least the
+      * requested size. Zero if the pointer is invalid.
+      */
+    size_t usable_size(const Pointer &p);
+    /** Returns a lower bound of the largest free block size in O(1). An
+      * allocation of N bytes succeeds when block_size(N) does not exceed it.
+      */
+    size_t largest_free_bound();
+
+    /** Returns the allocator statistics without walking the arena. The
+      * operation counters start from zero when the allocator is reattached.
+      */
+    AllocatorStats stats();
+
+    /** Returns the handle of the memory area. Unlike the pointer, the
+      * handle is valid in every process using the arena and may be stored
+      * in the arena itself.
+      */
+    uint64_t to_handle(const Pointer &p);
+    /** Returns the pointer for the handle or an invalid pointer if the
+      * memory area has been freed.
+      */
+    Pointer from_handle(uint64_t handle);
+
+    /** Remembers the memory area to find the data by when the arena is
+      * reattached.
+      */
+    void set_root(const Pointer &p);
+    /** Returns the root memory area or an invalid pointer if there is
+      * none.
+      */
+    Pointer root();
 
 private:
     struct AllocatorImpl;
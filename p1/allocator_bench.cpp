@@ -0,0 +1,864 @@
+#include "allocator.hpp"
+#include "arena_allocator.hpp"
+#include "block_pool.hpp"
+#include "mapped_arena.hpp"
+#include "numa_arena.hpp"
+#include "region_allocator.hpp"
+#include "object_pool.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+using namespace std;
+
+/** Arena size used by the benchmarks. */
+static const size_t ARENA_SIZE = 64 * 1024 * 1024;
+
+/** Deterministic pseudo-random generator to keep runs comparable. */
+static unsigned int nextRandom(unsigned int &state)
+{
+    state = state * 1103515245 + 12345;
+    return (state >> 16) & 0x7fff;
+}
+
+/** Returns nanoseconds elapsed since the specified moment. */
+static double elapsedNs(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, nano>(
+        chrono::steady_clock::now() - start
+    ).count();
+}
+
+/** Measures alloc/free latency against the number of live blocks. The heap
+  * is fragmented: every other block is freed so the number of free areas
+  * grows together with the number of live blocks.
+  */
+static void benchAllocScaling(void *arena)
+{
+    const size_t iterations = 20000;
+
+    cout << "alloc_scaling: live blocks / ns per alloc+free" << endl;
+    for (size_t live = 1000; live <= 64000; live *= 4) {
+        Allocator a(arena, ARENA_SIZE);
+        vector<Pointer> ptrs;
+        unsigned int state = 1;
+
+        for (size_t i = 0; i < 2 * live; i++) {
+            ptrs.push_back(a.alloc(16 + nextRandom(state) % 240));
+        }
+        for (size_t i = 0; i < ptrs.size(); i += 2) {
+            a.free(ptrs[i]);
+        }
+
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++) {
+            Pointer p = a.alloc(16 + nextRandom(state) % 240);
+            a.free(p);
+        }
+        double ns = elapsedNs(start) / iterations;
+
+        cout << "  " << live << "\t" << ns << endl;
+
+        for (size_t i = 1; i < ptrs.size(); i += 2) {
+            a.free(ptrs[i]);
+        }
+    }
+}
+
+/** Measures the cost of handing Pointers over to a vector: the alloc return
+  * path, copying and moving of 1M pointers.
+  */
+static void benchPointerVector(void *arena)
+{
+    const size_t count = 1000000;
+    Allocator a(arena, ARENA_SIZE);
+
+    auto start = chrono::steady_clock::now();
+    vector<Pointer> allocated;
+    for (size_t i = 0; i < count; i++) {
+        allocated.push_back(a.alloc(16));
+    }
+    double allocNs = elapsedNs(start) / count;
+
+    start = chrono::steady_clock::now();
+    vector<Pointer> copied;
+    for (const Pointer &p: allocated) {
+        copied.push_back(p);
+    }
+    double copyNs = elapsedNs(start) / count;
+
+    start = chrono::steady_clock::now();
+    vector<Pointer> moved;
+    for (Pointer &p: copied) {
+        moved.push_back(std::move(p));
+    }
+    double moveNs = elapsedNs(start) / count;
+
+    cout << "pointer_vector: ns per pointer" << endl;
+    cout << "  alloc+push\t" << allocNs << endl;
+    cout << "  copy push\t" << copyNs << endl;
+    cout << "  move push\t" << moveNs << endl;
+
+    for (Pointer &p: moved) {
+        a.free(p);
+    }
+}
+
+/** Small block churn of one thread: keeps up to 64 live blocks. The guard
+  * serialises the calls when the allocator is not concurrent.
+  */
+static void churn(Allocator &a, mutex *guard, unsigned int seed, size_t ops)
+{
+    vector<Pointer> live;
+    unsigned int state = seed;
+
+    for (size_t i = 0; i < ops; i++) {
+        size_t r = nextRandom(state);
+        if ((live.size() < 64) && (r % 2 || live.empty())) {
+            size_t size = 16 + r % 240;
+            if (guard) {
+                lock_guard<mutex> lock(*guard);
+                live.push_back(a.alloc(size));
+            } else {
+                live.push_back(a.alloc(size));
+            }
+        } else {
+            size_t index = r % live.size();
+            if (guard) {
+                lock_guard<mutex> lock(*guard);
+                a.free(live[index]);
+            } else {
+                a.free(live[index]);
+            }
+            live[index] = std::move(live.back());
+            live.pop_back();
+        }
+    }
+
+    for (Pointer &p: live) {
+        if (guard) {
+            lock_guard<mutex> lock(*guard);
+            a.free(p);
+        } else {
+            a.free(p);
+        }
+    }
+}
+
+/** Measures alloc/free throughput of 1 to N threads: the single-threaded
+  * allocator under a global mutex against the concurrent mode.
+  */
+static void benchThreadScaling(void *arena)
+{
+    const size_t ops = 1000000;
+    size_t maxThreads = thread::hardware_concurrency();
+    if (maxThreads < 4) {
+        maxThreads = 4;
+    }
+
+    cout << "thread_scaling: threads / Mops per second (global mutex, "
+        "concurrent)" << endl;
+    for (size_t threads = 1; threads <= maxThreads; threads *= 2) {
+        double mops[2];
+        for (int concurrent = 0; concurrent < 2; concurrent++) {
+            Allocator a(
+                arena, ARENA_SIZE, concurrent ?
+                AllocatorMode::Concurrent : AllocatorMode::SingleThreaded
+            );
+            mutex guard;
+
+            auto start = chrono::steady_clock::now();
+            vector<thread> workers;
+            for (size_t i = 0; i < threads; i++) {
+                workers.push_back(thread(
+                    churn, ref(a), concurrent ? nullptr : &guard, i + 1, ops
+                ));
+            }
+            for (thread &t: workers) {
+                t.join();
+            }
+            mops[concurrent] = (threads * ops) / (elapsedNs(start) / 1000);
+        }
+        cout << "  " << threads << "\t" << mops[0] << "\t" << mops[1] << endl;
+    }
+}
+
+/** Fills the arena with blocks of random sizes and frees every other one.
+  * @return Pointers to the remaining blocks.
+  */
+static vector<Pointer> fragment(Allocator &a, size_t count, size_t maxSize)
+{
+    vector<Pointer> ptrs;
+    unsigned int state = 7;
+
+    for (size_t i = 0; i < count; i++) {
+        ptrs.push_back(a.alloc(16 + nextRandom(state) % maxSize));
+    }
+    vector<Pointer> live;
+    for (size_t i = 0; i < count; i++) {
+        if (i % 2) {
+            live.push_back(std::move(ptrs[i]));
+        } else {
+            a.free(ptrs[i]);
+        }
+    }
+    return live;
+}
+
+/** Compares the pause of the full defrag with the pauses of budgeted
+  * defragmentation slices.
+  */
+static void benchDefragSlices(void *arena)
+{
+    const size_t count = 100000;
+    const size_t budget = 64 * 1024;
+
+    cout << "defrag_slices:" << endl;
+    {
+        Allocator a(arena, ARENA_SIZE);
+        vector<Pointer> live = fragment(a, count, 600);
+
+        auto start = chrono::steady_clock::now();
+        a.defrag();
+        cout << "  full defrag pause, us\t" << elapsedNs(start) / 1000 << endl;
+    }
+
+    Allocator a(arena, ARENA_SIZE);
+    vector<Pointer> live = fragment(a, count, 600);
+
+    size_t slices = 0;
+    double maxPause = 0, totalPause = 0;
+    DefragReport report;
+    do {
+        auto start = chrono::steady_clock::now();
+        report = a.defrag_step(budget);
+        double pause = elapsedNs(start) / 1000;
+
+        if (slices < 3) {
+            cout << "  slice " << slices << ": moved " << report.bytes_moved <<
+                " bytes, fragmentation " << report.fragmentation_before <<
+                " -> " << report.fragmentation_after << endl;
+        }
+        maxPause = (pause > maxPause) ? pause : maxPause;
+        totalPause += pause;
+        slices++;
+    } while (!report.done);
+
+    cout << "  " << slices << " slices of " << budget << " bytes, max pause, "
+        "us\t" << maxPause << endl;
+    cout << "  total of slices, us\t" << totalPause << endl;
+}
+
+/** Measures compaction of a highly fragmented arena: it is filled up with
+  * small blocks and every eighth one is freed, so there are many short runs
+  * of live blocks separated by small holes.
+  */
+static void benchDefragFragmented(void *arena)
+{
+    cout << "defrag_fragmented:" << endl;
+    for (int slices = 0; slices < 2; slices++) {
+        Allocator a(arena, ARENA_SIZE);
+        vector<Pointer> ptrs;
+        unsigned int state = 3;
+        try {
+            while (true) {
+                ptrs.push_back(a.alloc(16 + nextRandom(state) % 32));
+            }
+        } catch (AllocError &) {}
+        for (size_t i = 0; i < ptrs.size(); i += 8) {
+            a.free(ptrs[i]);
+        }
+
+        auto start = chrono::steady_clock::now();
+        if (slices) {
+            while (!a.defrag_step(64 * 1024).done) {}
+        } else {
+            a.defrag();
+        }
+        cout << "  " << ptrs.size() << " blocks, " << (slices ? "64KB slices" :
+            "full defrag") << ", ms\t" << elapsedNs(start) / 1000000 << endl;
+    }
+}
+
+/** Measures fragmentation over time of a realloc-heavy workload: buffers
+  * are randomly grown and shrunk in an arena that is about half full.
+  */
+static void benchReallocChurn(void *arena)
+{
+    const size_t buffers = 2000;
+    const size_t ops = 400000;
+    Allocator a(arena, 8 * 1024 * 1024);
+    vector<Pointer> ptrs(buffers);
+    unsigned int state = 11;
+    size_t moved = 0;
+
+    cout << "realloc_churn: ops / free areas / fragmentation / moved % / "
+        "ns per op" << endl;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 1; i <= ops; i++) {
+        size_t index = nextRandom(state) % buffers;
+        void *before = ptrs[index].get();
+        a.realloc(ptrs[index], 16 + nextRandom(state) % 4096);
+        moved += (before && before != ptrs[index].get()) ? 1 : 0;
+
+        if (i % (ops / 8) == 0) {
+            double ns = elapsedNs(start) / (ops / 8);
+            AllocatorStats stats = a.stats();
+            cout << "  " << i << "\t" << stats.free_blocks << "\t" <<
+                stats.fragmentation << "\t" << 100.0 * moved / (ops / 8) <<
+                "\t" << ns << endl;
+            moved = 0;
+            start = chrono::steady_clock::now();
+        }
+    }
+
+    for (Pointer &p: ptrs) {
+        a.free(p);
+    }
+}
+
+/** Compares alloc_batch/free_batch with loops of single calls for batches
+  * of same-sized objects on a fragmented arena.
+  */
+static void benchBatch(void *arena)
+{
+    const size_t batch = 1000;
+    const size_t rounds = 500;
+    vector<Pointer> ptrs(batch);
+
+    cout << "batch: ns per object (single calls, batch calls)" << endl;
+    for (size_t size = 16; size <= 256; size *= 4) {
+        double ns[2];
+        for (int batched = 0; batched < 2; batched++) {
+            Allocator a(arena, ARENA_SIZE);
+            vector<Pointer> live = fragment(a, 20000, 256);
+
+            auto start = chrono::steady_clock::now();
+            for (size_t r = 0; r < rounds; r++) {
+                if (batched) {
+                    a.alloc_batch(batch, size, ptrs.data());
+                    a.free_batch(ptrs.data(), batch);
+                } else {
+                    for (Pointer &p: ptrs) {
+                        p = a.alloc(size);
+                    }
+                    for (Pointer &p: ptrs) {
+                        a.free(p);
+                    }
+                }
+            }
+            ns[batched] = elapsedNs(start) / (rounds * batch);
+        }
+        cout << "  " << size << "\t" << ns[0] << "\t" << ns[1] << endl;
+    }
+}
+
+/** Object of the specified size for the slab benchmark. */
+template <size_t Size>
+struct Blob {
+    char data[Size];
+};
+
+/** Measures alloc+free of objects of one size: the pool against direct
+  * Allocator calls. Keeps a window of live objects to exercise the free
+  * lists rather than one hot block.
+  */
+template <size_t Size>
+static void benchSlabSize(void *arena)
+{
+    const size_t window = 1000;
+    const size_t rounds = 1000;
+    double ns[2];
+
+    {
+        Allocator a(arena, ARENA_SIZE);
+        vector<Pointer> live(window);
+
+        auto start = chrono::steady_clock::now();
+        for (size_t r = 0; r < rounds; r++) {
+            for (Pointer &p: live) {
+                p = a.alloc(Size);
+            }
+            for (Pointer &p: live) {
+                a.free(p);
+            }
+        }
+        ns[0] = elapsedNs(start) / (rounds * window);
+    }
+    {
+        Allocator a(arena, ARENA_SIZE);
+        ObjectPool<Blob<Size>> pool(a, 256);
+        vector<void*> live(window);
+
+        auto start = chrono::steady_clock::now();
+        for (size_t r = 0; r < rounds; r++) {
+            for (void *&p: live) {
+                p = pool.allocate();
+            }
+            for (void *p: live) {
+                pool.deallocate(p);
+            }
+        }
+        ns[1] = elapsedNs(start) / (rounds * window);
+    }
+    cout << "  " << Size << "\t" << ns[0] << "\t" << ns[1] << endl;
+}
+
+static void benchSlab(void *arena)
+{
+    cout << "slab: object size / ns per alloc+free (direct, pool)" << endl;
+    benchSlabSize<16>(arena);
+    benchSlabSize<64>(arena);
+    benchSlabSize<256>(arena);
+}
+
+/** Map-heavy request: fills a map, looks every key up and drops it.
+  * @return Checksum to keep the work from being optimised out.
+  */
+template <typename Map>
+static size_t mapRequest(Map &m, size_t keys, unsigned int seed)
+{
+    unsigned int state = seed;
+    for (size_t i = 0; i < keys; i++) {
+        m[nextRandom(state) * 32768 + nextRandom(state)] = i;
+    }
+    size_t sum = 0;
+    state = seed;
+    for (size_t i = 0; i < keys; i++) {
+        sum += m[nextRandom(state) * 32768 + nextRandom(state)];
+    }
+    return sum;
+}
+
+/** Compares the default allocator with the arena allocator and the
+  * monotonic arena on a map-heavy workload: every request builds its own
+  * map and throws it away.
+  */
+static void benchArenaMap(void *arena)
+{
+    typedef unordered_map<size_t, size_t> StdMap;
+    typedef unordered_map<size_t, size_t, hash<size_t>, equal_to<size_t>,
+        ArenaAllocator<pair<const size_t, size_t>>> ArenaMap;
+    const size_t requests = 200;
+    const size_t keys = 10000;
+    size_t sum = 0;
+
+    cout << "arena_map: ms for " << requests << " requests of " << keys <<
+        " keys" << endl;
+
+    auto start = chrono::steady_clock::now();
+    for (size_t r = 0; r < requests; r++) {
+        StdMap m;
+        sum += mapRequest(m, keys, r + 1);
+    }
+    cout << "  std::allocator\t" << elapsedNs(start) / 1000000 << endl;
+
+    Allocator a(arena, ARENA_SIZE);
+    start = chrono::steady_clock::now();
+    for (size_t r = 0; r < requests; r++) {
+        ArenaMap m(0, hash<size_t>(), equal_to<size_t>(), a);
+        sum += mapRequest(m, keys, r + 1);
+    }
+    cout << "  ArenaAllocator\t" << elapsedNs(start) / 1000000 << endl;
+
+    MonotonicArena monotonic(a);
+    start = chrono::steady_clock::now();
+    for (size_t r = 0; r < requests; r++) {
+        {
+            ArenaMap m(0, hash<size_t>(), equal_to<size_t>(), monotonic);
+            sum += mapRequest(m, keys, r + 1);
+        }
+        monotonic.release();
+    }
+    cout << "  MonotonicArena\t" << elapsedNs(start) / 1000000 << endl;
+    cout << "  checksum\t" << sum << endl;
+}
+
+/** Compares the warm restart of a mapped arena with repopulating the data:
+  * 500K areas are allocated, the arena is closed and reopened.
+  */
+static void benchReattach(void *)
+{
+    const size_t count = 500000;
+    const size_t size = 256 * 1024 * 1024;
+    string path = "/tmp/allocator_bench_arena." + to_string(getpid());
+    unlink(path.c_str());
+
+    cout << "reattach: ms" << endl;
+    {
+        MappedArena arena(path, size);
+        Allocator &a = arena.allocator();
+        vector<Pointer> ptrs;
+
+        auto start = chrono::steady_clock::now();
+        Pointer table = a.alloc(count * sizeof(uint32_t));
+        for (size_t i = 0; i < count; i++) {
+            ptrs.push_back(a.alloc(64 + i % 128));
+            memset(ptrs.back().get(), (int)i, 64);
+        }
+        a.set_root(table);
+        cout << "  populate\t" << elapsedNs(start) / 1000000 << endl;
+    }
+
+    auto start = chrono::steady_clock::now();
+    {
+        MappedArena arena(path, size);
+        if (!arena.reattached() || !arena.allocator().root().get()) {
+            cerr << "The arena has not been reattached" << endl;
+        }
+        cout << "  reattach\t" << elapsedNs(start) / 1000000 << endl;
+    }
+    unlink(path.c_str());
+}
+
+/** Returns the resident set size of the process in MB. */
+static double residentMb()
+{
+    ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * (double)sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+/** Reports RSS over time of a bursty workload on the growable allocator:
+  * every burst allocates about 200 MB, keeps a small fraction of it and
+  * frees the rest.
+  */
+static void benchRegionsRss(void *)
+{
+    const size_t burst = 400000;
+    RegionAllocator a(16 * 1024 * 1024);
+    vector<Pointer> kept;
+    unsigned int state = 5;
+
+    cout << "regions_rss: phase / regions / mapped MB / RSS MB / ms" << endl;
+    for (int round = 0; round < 4; round++) {
+        auto start = chrono::steady_clock::now();
+        vector<Pointer> ptrs;
+        for (size_t i = 0; i < burst; i++) {
+            ptrs.push_back(a.alloc(64 + nextRandom(state) % 960));
+            memset(ptrs.back().get(), 1, 64);
+        }
+        cout << "  burst " << round << "\t" << a.region_count() << "\t" <<
+            a.mapped_bytes() / (1024 * 1024) << "\t" << residentMb() <<
+            "\t" << elapsedNs(start) / 1000000 << endl;
+
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < ptrs.size(); i++) {
+            if (i % 100 == 0) {
+                kept.push_back(std::move(ptrs[i]));
+            } else {
+                a.free(ptrs[i]);
+            }
+        }
+        cout << "  idle " << round << "\t" << a.region_count() << "\t" <<
+            a.mapped_bytes() / (1024 * 1024) << "\t" << residentMb() <<
+            "\t" << elapsedNs(start) / 1000000 << endl;
+
+        // Survivors pin every region, their free pages are released
+        start = chrono::steady_clock::now();
+        a.defrag();
+        a.trim();
+        cout << "  trim " << round << "\t" << a.region_count() << "\t" <<
+            a.mapped_bytes() / (1024 * 1024) << "\t" << residentMb() <<
+            "\t" << elapsedNs(start) / 1000000 << endl;
+    }
+
+    for (Pointer &p: kept) {
+        a.free(p);
+    }
+    cout << "  end\t" << a.region_count() << "\t" <<
+        a.mapped_bytes() / (1024 * 1024) << "\t" << residentMb() << endl;
+}
+
+/**
+  * @brief Single-producer single-consumer ring passing blocks from the
+  * allocating thread to the freeing one.
+  */
+template <typename T>
+struct Handoff {
+    static const size_t CAPACITY = 1024;
+
+    Handoff(): head(0), tail(0) {}
+
+    /** Returns false if the ring is full. */
+    bool push(T &item) {
+        size_t tail = this->tail.load(memory_order_relaxed);
+        if (tail - this->head.load(memory_order_acquire) == CAPACITY) {
+            return false;
+        }
+        this->items[tail % CAPACITY] = std::move(item);
+        this->tail.store(tail + 1, memory_order_release);
+        return true;
+    }
+
+    /** Returns false if the ring is empty. */
+    bool pop(T &item) {
+        size_t head = this->head.load(memory_order_relaxed);
+        if (head == this->tail.load(memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(this->items[head % CAPACITY]);
+        this->head.store(head + 1, memory_order_release);
+        return true;
+    }
+
+    T items[CAPACITY];
+    alignas(64) atomic<size_t> head;
+    alignas(64) atomic<size_t> tail;
+};
+
+/** Runs producer and consumer pairs: the producer allocates blocks, the
+  * consumer frees them.
+  * @return Millions of blocks per second passed by all the pairs.
+  */
+template <typename T, typename Alloc, typename Release>
+static double crossThreadRun(
+    size_t pairs, size_t count, Alloc alloc, Release release
+)
+{
+    vector<Handoff<T>> rings(pairs);
+    vector<thread> threads;
+
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < pairs; i++) {
+        Handoff<T>& ring = rings[i];
+        threads.push_back(thread([&ring, count, alloc]() {
+            for (size_t j = 0; j < count; j++) {
+                T item = alloc();
+                while (!ring.push(item)) {
+                    this_thread::yield();
+                }
+            }
+        }));
+        threads.push_back(thread([&ring, count, release]() {
+            T item;
+            for (size_t j = 0; j < count; j++) {
+                while (!ring.pop(item)) {
+                    this_thread::yield();
+                }
+                release(item);
+            }
+        }));
+    }
+    for (thread &t: threads) {
+        t.join();
+    }
+    return (pairs * count) / (elapsedNs(start) / 1000);
+}
+
+/** Compares the concurrent Allocator with the lock-free block pool when
+  * blocks are allocated on one thread and freed on another.
+  */
+static void benchCrossThread(void *arena)
+{
+    const size_t count = 500000;
+    const size_t size = 64;
+    size_t maxPairs = thread::hardware_concurrency() / 2;
+    if (maxPairs < 2) {
+        maxPairs = 2;
+    }
+
+    cout << "cross_thread: producer/consumer pairs / Mops per second "
+        "(concurrent allocator, block pool)" << endl;
+    for (size_t pairs = 1; pairs <= maxPairs; pairs *= 2) {
+        double mops[2];
+        {
+            Allocator a(arena, ARENA_SIZE, AllocatorMode::Concurrent);
+            mops[0] = crossThreadRun<Pointer>(
+                pairs, count,
+                [&a]() { return a.alloc(size); },
+                [&a](Pointer &p) { a.free(p); }
+            );
+        }
+        {
+            Allocator a(arena, ARENA_SIZE, AllocatorMode::Concurrent);
+            BlockPool pool(a, size, 4096);
+            mops[1] = crossThreadRun<void*>(
+                pairs, count,
+                [&pool]() { return pool.allocate(); },
+                [&pool](void *p) { pool.deallocate(p); }
+            );
+        }
+        cout << "  " << pairs << "\t" << mops[0] << "\t" << mops[1] << endl;
+    }
+}
+
+/**
+  * @brief Counter of the data TLB misses of the calling thread. Counts
+  * nothing when perf events are not available, e.g. in a container.
+  */
+class TlbMissCounter {
+public:
+    TlbMissCounter() {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        this->fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~TlbMissCounter() {
+        if (this->fd != -1) {
+            close(this->fd);
+        }
+    }
+
+    bool available() const { return this->fd != -1; }
+
+    void start() {
+        if (this->fd != -1) {
+            ioctl(this->fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(this->fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    /** Returns the misses since start. */
+    uint64_t stop() {
+        uint64_t count = 0;
+        if (this->fd != -1) {
+            ioctl(this->fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(this->fd, &count, sizeof(count)) != sizeof(count)) {
+                count = 0;
+            }
+        }
+        return count;
+    }
+
+private:
+    int fd;
+};
+
+/** Touches memory areas scattered over a large arena in random order with
+  * regular, transparent huge and explicit huge pages. Reports the backing
+  * the arena has got, ns per access and data TLB misses per access.
+  */
+static void benchHugePages(void *)
+{
+    const size_t size = 512 * 1024 * 1024;
+    const size_t count = 3 * 1024 * 1024;
+    const size_t rounds = 4;
+    const HugePages requested[] = {
+        HugePages::Regular, HugePages::Transparent, HugePages::Explicit
+    };
+    const char* names[] = {"regular", "transparent", "explicit"};
+
+    TlbMissCounter misses;
+    cout << "huge_pages: requested / backing / ns per access / dTLB misses "
+        "per access / checksum" << (misses.available() ? "" : " (perf unavailable)") <<
+        endl;
+    for (HugePages pages: requested) {
+        HugePageArena arena(size, -1, pages);
+        Allocator &a = arena.allocator();
+
+        vector<Pointer> ptrs;
+        for (size_t i = 0; i < count; i++) {
+            ptrs.push_back(a.alloc(100));
+            memset(ptrs.back().get(), (int)i, 100);
+        }
+
+        // Plain pointers in random order, so only the arena is scattered
+        vector<unsigned char*> order;
+        for (Pointer &p: ptrs) {
+            order.push_back(static_cast<unsigned char*>(p.get()));
+        }
+        unsigned int state = 11;
+        for (size_t i = order.size() - 1; i > 0; i--) {
+            size_t j = (nextRandom(state) * 32768 + nextRandom(state)) %
+                (i + 1);
+            swap(order[i], order[j]);
+        }
+
+        size_t sum = 0;
+        misses.start();
+        auto start = chrono::steady_clock::now();
+        for (size_t r = 0; r < rounds; r++) {
+            for (unsigned char* p: order) {
+                sum += p[r * 16];
+            }
+        }
+        double ns = elapsedNs(start);
+        uint64_t missed = misses.stop();
+
+        size_t accesses = rounds * order.size();
+        cout << "  " << names[(int)pages] << "\t" <<
+            names[(int)arena.pages()] << "\t" << ns / accesses << "\t";
+        if (misses.available()) {
+            cout << (double)missed / accesses;
+        } else {
+            cout << "-";
+        }
+        cout << "\t" << sum % 10 << endl;
+
+        for (Pointer &p: ptrs) {
+            a.free(p);
+        }
+    }
+}
+
+/**
+  * @brief Benchmark scenario description.
+  */
+struct Scenario {
+    /** Name used to select the scenario from the command line. */
+    const char* name;
+    /** Scenario routine. Receives the arena of ARENA_SIZE bytes. */
+    void (*run)(void* arena);
+};
+
+static const Scenario scenarios[] = {
+    {"alloc_scaling", benchAllocScaling},
+    {"pointer_vector", benchPointerVector},
+    {"thread_scaling", benchThreadScaling},
+    {"defrag_slices", benchDefragSlices},
+    {"defrag_fragmented", benchDefragFragmented},
+    {"realloc_churn", benchReallocChurn},
+    {"batch", benchBatch},
+    {"slab", benchSlab},
+    {"cross_thread", benchCrossThread},
+    {"arena_map", benchArenaMap},
+    {"reattach", benchReattach},
+    {"regions_rss", benchRegionsRss},
+    {"huge_pages", benchHugePages},
+};
+
+int main(int argc, char* argv[])
+{
+    void *arena = malloc(ARENA_SIZE);
+    if (!arena) {
+        cerr << "Unable to allocate the benchmark arena" << endl;
+        return 1;
+    }
+
+    for (const Scenario &s: scenarios) {
+        // Run all the scenarios or only the ones specified
+        bool selected = (argc < 2);
+        for (int i = 1; i < argc; i++) {
+            selected = selected || (strcmp(argv[i], s.name) == 0);
+        }
+        if (selected) {
+            s.run(arena);
+        }
+    }
+
+    free(arena);
+    return 0;
+}
@@ -0,0 +1,314 @@
+#include "allocator.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <sstream>
+#include <vector>
+
+using namespace std;
+
+/**
+  * @brief Operation of a workload. Areas are identified by the trace ids.
+  */
+struct Op {
+    /** 'a' - alloc, 'r' - realloc, 'f' - free. */
+    char type;
+    uint32_t id;
+    /** Requested size, unused by free. */
+    size_t size;
+};
+
+/** Deterministic pseudo-random generator to keep runs comparable. */
+static unsigned int nextRandom(unsigned int &state)
+{
+    state = state * 1103515245 + 12345;
+    return (state >> 16) & 0x7fff;
+}
+
+/** Parses the trace: one operation per line, "a <id> <size>",
+  * "r <id> <size>" or "f <id>". Empty lines and lines starting with # are
+  * skipped.
+  * @return False if the trace cannot be read.
+  */
+static bool readTrace(const char *path, vector<Op> &ops)
+{
+    ifstream in(path);
+    if (!in) {
+        cerr << "Unable to open the trace " << path << endl;
+        return false;
+    }
+
+    string line;
+    size_t number = 0;
+    while (getline(in, line)) {
+        number++;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        istringstream fields(line);
+        Op op;
+        op.size = 0;
+        fields >> op.type >> op.id;
+        if (op.type != 'f') {
+            fields >> op.size;
+        }
+        if (!fields || (op.type != 'a' && op.type != 'r' && op.type != 'f')) {
+            cerr << path << ":" << number << ": invalid operation" << endl;
+            return false;
+        }
+        ops.push_back(op);
+    }
+    return true;
+}
+
+/**
+  * @brief Synthetic workload description.
+  */
+struct Distribution {
+    /** Name used to select the distribution from the command line. */
+    const char* name;
+    /** Returns the size of a new area. */
+    size_t (*size)(unsigned int &state);
+    /** Returns the lifetime of a new area in operations. */
+    size_t (*lifetime)(unsigned int &state);
+    /** Percentage of operations which reallocate a live area. */
+    unsigned int realloc_percent;
+};
+
+static size_t uniformSize(unsigned int &state)
+{
+    return 16 + nextRandom(state) % 4080;
+}
+
+/** Mostly small areas: the size halves with every step of probability. */
+static size_t smallSize(unsigned int &state)
+{
+    size_t size = 4096;
+    while ((size > 16) && (nextRandom(state) % 4 != 0)) {
+        size /= 2;
+    }
+    return size / 2 + nextRandom(state) % (size / 2);
+}
+
+static size_t shortLifetime(unsigned int &state)
+{
+    return 1 + nextRandom(state) % 64;
+}
+
+/** Most areas die young, some live through the whole run. */
+static size_t mixedLifetime(unsigned int &state)
+{
+    unsigned int r = nextRandom(state) % 100;
+    if (r < 80) {
+        return 1 + nextRandom(state) % 100;
+    }
+    if (r < 98) {
+        return 1000 + nextRandom(state) * 4;
+    }
+    return (size_t)-1;
+}
+
+static const Distribution distributions[] = {
+    {"uniform", uniformSize, shortLifetime, 0},
+    {"small", smallSize, mixedLifetime, 0},
+    {"mixed", uniformSize, mixedLifetime, 0},
+    {"realloc", smallSize, mixedLifetime, 30},
+};
+
+/** Generates the synthetic workload. Every area gets a size and a lifetime
+  * and is freed when the lifetime expires or at the end.
+  */
+static void generate(const Distribution &d, size_t count, vector<Op> &ops)
+{
+    typedef pair<size_t, uint32_t> Death;
+    priority_queue<Death, vector<Death>, greater<Death>> deaths;
+    vector<uint32_t> live;
+    vector<size_t> position;
+    unsigned int state = 1;
+    uint32_t nextId = 0;
+
+    for (size_t t = 0; t < count; t++) {
+        while (!deaths.empty() && deaths.top().first <= t) {
+            uint32_t id = deaths.top().second;
+            deaths.pop();
+            ops.push_back(Op{'f', id, 0});
+
+            // Remove from the live set in O(1)
+            live[position[id]] = live.back();
+            position[live.back()] = position[id];
+            live.pop_back();
+        }
+
+        if (!live.empty() && (nextRandom(state) % 100 < d.realloc_percent)) {
+            uint32_t id = live[nextRandom(state) % live.size()];
+            ops.push_back(Op{'r', id, d.size(state)});
+            continue;
+        }
+
+        uint32_t id = nextId++;
+        ops.push_back(Op{'a', id, d.size(state)});
+        position.push_back(live.size());
+        live.push_back(id);
+        size_t lifetime = d.lifetime(state);
+        if (lifetime != (size_t)-1) {
+            deaths.push(Death(t + lifetime, id));
+        }
+    }
+
+    for (uint32_t id: live) {
+        ops.push_back(Op{'f', id, 0});
+    }
+}
+
+/** Prints percentiles of the operation latencies. */
+static void printLatency(const char *name, vector<uint32_t> &ns)
+{
+    if (ns.empty()) {
+        return;
+    }
+    sort(ns.begin(), ns.end());
+    const double points[] = {0.5, 0.9, 0.99, 0.999};
+
+    cout << "  " << name << "\t" << ns.size() << " ops, ns:";
+    for (double p: points) {
+        cout << " p" << p * 100 << "=" << ns[(size_t)(p * (ns.size() - 1))];
+    }
+    cout << " max=" << ns.back() << endl;
+}
+
+/** Replays the workload and prints the report. */
+static void replay(const vector<Op> &ops, void *arena, size_t arenaSize)
+{
+    Allocator a(arena, arenaSize);
+    vector<Pointer> areas;
+    vector<uint32_t> latency[3];
+    double peakFragmentation = 0;
+    size_t peakAllocated = 0;
+    size_t failed = 0;
+
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < ops.size(); i++) {
+        const Op &op = ops[i];
+        if (op.id >= areas.size()) {
+            areas.resize(op.id + 1);
+        }
+
+        auto before = chrono::steady_clock::now();
+        try {
+            switch (op.type) {
+            case 'a':
+                areas[op.id] = a.alloc(op.size);
+                break;
+            case 'r':
+                a.realloc(areas[op.id], op.size);
+                break;
+            default:
+                a.free(areas[op.id]);
+                break;
+            }
+        } catch (AllocError &) {
+            failed++;
+        }
+        auto after = chrono::steady_clock::now();
+
+        int kind = (op.type == 'a') ? 0 : (op.type == 'r') ? 1 : 2;
+        latency[kind].push_back((uint32_t)chrono::duration_cast<
+            chrono::nanoseconds>(after - before).count());
+
+        // Stats are cheap but not free, sample them
+        if (i % 256 == 0) {
+            AllocatorStats stats = a.stats();
+            peakFragmentation = max(peakFragmentation, stats.fragmentation);
+            peakAllocated = max(peakAllocated, stats.bytes_allocated);
+        }
+    }
+    double seconds = chrono::duration<double>(
+        chrono::steady_clock::now() - start
+    ).count();
+
+    cout << "  total\t" << ops.size() << " ops, " << ops.size() / seconds /
+        1e6 << " Mops per second (timing included)" << endl;
+    printLatency("alloc", latency[0]);
+    printLatency("realloc", latency[1]);
+    printLatency("free", latency[2]);
+    cout << "  peak allocated\t" << peakAllocated << " bytes" << endl;
+    cout << "  peak fragmentation\t" << peakFragmentation << endl;
+    if (failed) {
+        cout << "  failed\t" << failed << " ops (out of memory or invalid "
+            "trace)" << endl;
+    }
+}
+
+static void usage()
+{
+    cerr << "Usage: allocator_replay [-m arena MB] [-n ops] "
+        "<trace file | synthetic distribution>..." << endl;
+    cerr << "Distributions:";
+    for (const Distribution &d: distributions) {
+        cerr << " " << d.name;
+    }
+    cerr << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t arenaSize = 256 * 1024 * 1024;
+    size_t count = 1000000;
+    vector<const char*> workloads;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-m") == 0) && (i + 1 < argc)) {
+            arenaSize = strtoull(argv[++i], nullptr, 10) * 1024 * 1024;
+        } else if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc)) {
+            count = strtoull(argv[++i], nullptr, 10);
+        } else {
+            workloads.push_back(argv[i]);
+        }
+    }
+    if (workloads.empty()) {
+        for (const Distribution &d: distributions) {
+            workloads.push_back(d.name);
+        }
+    }
+    if (arenaSize == 0) {
+        usage();
+        return 1;
+    }
+
+    void *arena = malloc(arenaSize);
+    if (!arena) {
+        cerr << "Unable to allocate the arena" << endl;
+        return 1;
+    }
+
+    int result = 0;
+    for (const char *name: workloads) {
+        vector<Op> ops;
+        const Distribution *d = nullptr;
+        for (const Distribution &candidate: distributions) {
+            if (strcmp(candidate.name, name) == 0) {
+                d = &candidate;
+            }
+        }
+
+        if (d) {
+            generate(*d, count, ops);
+        } else if (!readTrace(name, ops)) {
+            usage();
+            result = 1;
+            continue;
+        }
+
+        cout << name << ":" << endl;
+        replay(ops, arena, arenaSize);
+    }
+
+    free(arena);
+    return result;
+}
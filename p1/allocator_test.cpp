@@ -1,8 +1,24 @@
 #include "allocator.hpp"
-
+#include "arena_allocator.hpp"
+#include "block_pool.hpp"
+#include "mapped_arena.hpp"
+#include "numa_arena.hpp"
+#include "object_pool.hpp"
+#include "region_allocator.hpp"
+#include "shared_arena.hpp"
+
+#include <cstring>
 #include <vector>
 #include <set>
+#include <string>
+#include <unordered_map>
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "gtest/gtest.h"
 
 using namespace std;
@@ -319,3 +335,1302 @@ TEST(Allocator, ReallocGrow) {
     a.free(p2);
 }
 
+
+TEST(Allocator, AllocBestFit) {
+    Allocator a(buf, sizeof(buf));
+
+    int size = 135;
+    Pointer p1 = a.alloc(size);
+    Pointer gap1 = a.alloc(size * 3);
+    Pointer p2 = a.alloc(size);
+    Pointer gap2 = a.alloc(size);
+    Pointer p3 = a.alloc(size);
+
+    // Free areas of different sizes separated by allocated ones
+    void *smallGap = gap2.get();
+    a.free(gap1);
+    a.free(gap2);
+
+    Pointer p = a.alloc(size);
+    EXPECT_EQ(p.get(), smallGap);
+
+    a.free(p);
+    a.free(p1);
+    a.free(p2);
+    a.free(p3);
+}
+
+TEST(Allocator, AllocWholeFreeSpace) {
+    alignas(64) static char arena[300000];
+
+    // The request rounded up to the next size class does not fit, the block
+    // of its own class does
+    for (size_t size: {20000, 100000, 300000}) {
+        Allocator a(arena, size);
+        size_t largest = a.stats().largest_free;
+        size_t N = largest - Allocator::block_overhead();
+        while (Allocator::block_size(N) > largest) {
+            N--;
+        }
+
+        Pointer p = a.alloc(N);
+        writeTo(p, N);
+        EXPECT_TRUE(isDataOk(p, N));
+        EXPECT_EQ(a.stats().largest_free, 0);
+        a.free(p);
+
+        p = a.alloc(size - 200);
+        EXPECT_NE(p.get(), nullptr);
+        a.free(p);
+    }
+}
+
+TEST(Allocator, BlockSizeAccounting) {
+    const size_t count = 10;
+    size_t size = 100;
+
+    EXPECT_GE(Allocator::block_size(size), size + Allocator::block_overhead());
+
+    // The arena sized with block_size() holds exactly the planned blocks
+    alignas(64) static char arena[4096];
+    ASSERT_LE(count * Allocator::block_size(size), sizeof(arena));
+    Allocator a(arena, count * Allocator::block_size(size));
+
+    vector<Pointer> ptrs;
+    for (size_t i = 0; i < count; i++) {
+        ptrs.push_back(a.alloc(size));
+        writeTo(ptrs.back(), size);
+    }
+    EXPECT_THROW(a.alloc(1), AllocError);
+
+    for (Pointer &p: ptrs) {
+        EXPECT_TRUE(isDataOk(p, size));
+        a.free(p);
+    }
+}
+
+TEST(Allocator, FreeCoalesce) {
+    Allocator a(buf, sizeof(buf));
+
+    vector<Pointer> ptrs;
+    int size = 135;
+
+    ASSERT_TRUE(fillUp(a, size, ptrs));
+    void *first = ptrs[4].get();
+
+    // Three neighbours freed in any order give one contiguous area
+    a.free(ptrs[5]);
+    a.free(ptrs[4]);
+    a.free(ptrs[6]);
+
+    Pointer p = a.alloc(size * 3);
+    EXPECT_EQ(p.get(), first);
+    writeTo(p, size * 3);
+
+    for (size_t i = 0; i < ptrs.size(); i++) {
+        if (i < 4 || i > 6) {
+            EXPECT_TRUE(isDataOk(ptrs[i], size));
+            a.free(ptrs[i]);
+        }
+    }
+    a.free(p);
+}
+
+TEST(Allocator, StaleCopy) {
+    Allocator a(buf, sizeof(buf));
+
+    int size = 135;
+    Pointer p = a.alloc(size);
+    Pointer copy = p;
+    EXPECT_EQ(copy.get(), p.get());
+
+    a.free(p);
+    EXPECT_EQ(copy.get(), nullptr);
+
+    // The slot is reused by the new allocation, the copy remains stale
+    Pointer p2 = a.alloc(size);
+    EXPECT_EQ(copy.get(), nullptr);
+
+    try {
+        a.free(copy);
+        EXPECT_TRUE(false);
+    } catch (AllocError &e) {
+        EXPECT_EQ(e.getType(), AllocErrorType::InvalidFree);
+    }
+
+    a.free(p2);
+}
+
+TEST(Allocator, PointerMove) {
+    Allocator a(buf, sizeof(buf));
+
+    int size = 135;
+    Pointer p = a.alloc(size);
+    void *ptr = p.get();
+
+    Pointer moved(std::move(p));
+    EXPECT_EQ(p.get(), nullptr);
+    EXPECT_EQ(moved.get(), ptr);
+
+    Pointer other = a.alloc(size);
+    void *otherPtr = other.get();
+    swap(moved, other);
+    EXPECT_EQ(moved.get(), otherPtr);
+    EXPECT_EQ(other.get(), ptr);
+
+    p = std::move(other);
+    EXPECT_EQ(other.get(), nullptr);
+    EXPECT_EQ(p.get(), ptr);
+
+    a.free(p);
+    a.free(moved);
+}
+
+TEST(Allocator, ConcurrentStress) {
+    static char arena[4 * 1024 * 1024];
+    Allocator a(arena, sizeof(arena), AllocatorMode::Concurrent);
+
+    const int threadCount = 4;
+    const int iterations = 20000;
+
+    // Pointers handed over to be freed by another thread
+    mutex handoverLock;
+    vector<pair<Pointer, size_t>> handover;
+    atomic<int> errors(0);
+
+    auto worker = [&](int id) {
+        unsigned int state = id + 1;
+        vector<pair<Pointer, size_t>> live;
+
+        for (int i = 0; i < iterations; i++) {
+            state = state * 1103515245 + 12345;
+            unsigned int r = (state >> 16) & 0x7fff;
+
+            if ((r % 3 != 0) || live.empty()) {
+                size_t size = (r % 50 == 0) ? 2000 + r % 1000 : 1 + r % 300;
+                try {
+                    live.push_back(make_pair(a.alloc(size), size));
+                    writeTo(live.back().first, size);
+                } catch (AllocError &) {
+                    // The arena is exhausted, continue with frees
+                }
+            } else {
+                size_t index = r % live.size();
+                if (!isDataOk(live[index].first, live[index].second)) {
+                    errors++;
+                }
+                if (r % 2) {
+                    a.free(live[index].first);
+                } else {
+                    lock_guard<mutex> guard(handoverLock);
+                    handover.push_back(live[index]);
+                }
+                live.erase(live.begin() + index);
+            }
+
+            // Free a pointer allocated by another thread
+            if (r % 7 == 0) {
+                pair<Pointer, size_t> foreign;
+                {
+                    lock_guard<mutex> guard(handoverLock);
+                    if (!handover.empty()) {
+                        foreign = handover.back();
+                        handover.pop_back();
+                    }
+                }
+                if (foreign.first.get()) {
+                    if (!isDataOk(foreign.first, foreign.second)) {
+                        errors++;
+                    }
+                    a.free(foreign.first);
+                }
+            }
+        }
+
+        for (auto &p: live) {
+            if (!isDataOk(p.first, p.second)) {
+                errors++;
+            }
+            a.free(p.first);
+        }
+    };
+
+    vector<thread> threads;
+    for (int i = 0; i < threadCount; i++) {
+        threads.push_back(thread(worker, i));
+    }
+    for (thread &t: threads) {
+        t.join();
+    }
+
+    EXPECT_EQ(errors.load(), 0);
+    for (auto &p: handover) {
+        EXPECT_TRUE(isDataOk(p.first, p.second));
+        a.free(p.first);
+    }
+
+    // Caches of the finished threads are returned to the arena
+    Pointer whole = a.alloc(sizeof(arena) / 2);
+    EXPECT_NE(whole.get(), nullptr);
+    a.free(whole);
+}
+
+/** Runs threads allocating and freeing against a thread compacting the
+  * arena. The memory areas are not touched: defrag may move them.
+  * @arg steps - compact with defrag_step slices instead of defrag.
+  */
+static void freeWhileDefrag(bool steps) {
+    static char arena[256 * 1024];
+    Allocator a(arena, sizeof(arena), AllocatorMode::Concurrent);
+
+    const int threadCount = 3;
+    const int iterations = 50000;
+    atomic<bool> stop(false);
+
+    auto worker = [&](int id) {
+        minstd_rand random(id + 1);
+        vector<Pointer> live;
+        for (int i = 0; i < iterations; i++) {
+            if ((random() % 2) || live.empty()) {
+                // Both the cached and the larger blocks
+                size_t size = 1 + random() % 2000;
+                try {
+                    live.push_back(a.alloc(size));
+                } catch (AllocError &) {
+                    // The arena is exhausted, continue with frees
+                }
+            }
+            if ((live.size() > 30) || ((random() % 2) && !live.empty())) {
+                size_t index = random() % live.size();
+                a.free(live[index]);
+                live.erase(live.begin() + index);
+            }
+        }
+        for (Pointer &p: live) {
+            a.free(p);
+        }
+    };
+
+    thread compactor([&]() {
+        while (!stop) {
+            if (steps) {
+                a.defrag_step(4096);
+            } else {
+                a.defrag();
+            }
+        }
+    });
+    vector<thread> threads;
+    for (int i = 0; i < threadCount; i++) {
+        threads.push_back(thread(worker, i));
+    }
+    for (thread &t: threads) {
+        t.join();
+    }
+    stop = true;
+    compactor.join();
+
+    EXPECT_NO_THROW(a.check());
+    a.defrag();
+    EXPECT_EQ(a.stats().free_blocks, 1);
+}
+
+TEST(Allocator, ConcurrentFreeDefrag) {
+    freeWhileDefrag(false);
+}
+
+TEST(Allocator, ConcurrentFreeDefragSteps) {
+    freeWhileDefrag(true);
+}
+
+TEST(Allocator, ConcurrentDoubleFree) {
+    Allocator a(buf, sizeof(buf), AllocatorMode::Concurrent);
+
+    Pointer p = a.alloc(100);
+    Pointer copy = p;
+    a.free(p);
+
+    // The cached block is not reachable through the stale copy
+    EXPECT_EQ(copy.get(), nullptr);
+    EXPECT_THROW(a.free(copy), AllocError);
+
+    Pointer p2 = a.alloc(100);
+    EXPECT_EQ(copy.get(), nullptr);
+    a.free(p2);
+}
+
+TEST(Allocator, DefragSteps) {
+    Allocator a(buf, sizeof(buf));
+
+    vector<Pointer> ptrs;
+    int size = 135;
+
+    ASSERT_TRUE(fillUp(a, size, ptrs));
+    for (size_t i = 1; i < ptrs.size(); i += 4) {
+        a.free(ptrs[i]);
+    }
+    for (size_t i = 1; i < ptrs.size(); i += 3) {
+        ptrs.erase(ptrs.begin() + i);
+    }
+
+    const size_t budget = 1024;
+    DefragReport report;
+    int slices = 0;
+    do {
+        report = a.defrag_step(budget);
+        slices++;
+
+        EXPECT_LE(report.bytes_moved, budget);
+        EXPECT_LE(report.fragmentation_after, report.fragmentation_before);
+
+        // Pointers and data survive between the slices
+        for (Pointer &p: ptrs) {
+            EXPECT_TRUE(isDataOk(p, size));
+        }
+
+        // The arena is usable between the slices
+        Pointer temp = a.alloc(size);
+        writeTo(temp, size);
+        a.free(temp);
+    } while (!report.done && slices < 1000);
+
+    EXPECT_TRUE(report.done);
+    EXPECT_GT(slices, 1);
+    EXPECT_EQ(report.fragmentation_after, 0);
+
+    Pointer big = a.alloc(size * 10);
+    writeTo(big, size * 10);
+    a.free(big);
+
+    for (Pointer &p: ptrs) {
+        EXPECT_TRUE(isDataOk(p, size));
+        a.free(p);
+    }
+}
+
+TEST(Allocator, ReallocGrowBothWays) {
+    Allocator a(buf, sizeof(buf));
+
+    int size = 135;
+    Pointer p1 = a.alloc(size);
+    Pointer p2 = a.alloc(size);
+    Pointer p3 = a.alloc(size);
+    Pointer p4 = a.alloc(size);
+    writeTo(p2, size);
+
+    // Neither neighbour alone is enough, both together are
+    void *first = p1.get();
+    a.free(p1);
+    a.free(p3);
+    a.realloc(p2, size * 3);
+
+    EXPECT_EQ(p2.get(), first);
+    EXPECT_TRUE(isDataOk(p2, size));
+    writeTo(p2, size * 3);
+    writeTo(p4, size);
+    EXPECT_TRUE(isDataOk(p2, size * 3));
+
+    a.free(p2);
+    a.free(p4);
+}
+
+static size_t countFreeAreas(Allocator &a) {
+    string d = a.dump();
+    size_t count = 0;
+    for (size_t pos = d.find("FREE"); pos != string::npos; pos = d.find("FREE", pos + 1)) {
+        count++;
+    }
+    return count;
+}
+
+TEST(Allocator, ReallocCyclesNoFragments) {
+    Allocator a(buf, sizeof(buf));
+
+    int size = 1000;
+    Pointer p = a.alloc(size);
+    writeTo(p, size);
+
+    // Shrunk tails of any size join the free area after the block
+    void *ptr = p.get();
+    for (int i = 0; i < 100; i++) {
+        a.realloc(p, size - 8 - i % 50);
+        a.realloc(p, size + i % 50);
+        EXPECT_EQ(p.get(), ptr);
+    }
+    EXPECT_EQ(countFreeAreas(a), 1);
+    EXPECT_TRUE(isDataOk(p, size - 58));
+
+    a.free(p);
+}
+
+TEST(Allocator, Stats) {
+    Allocator a(buf, sizeof(buf));
+
+    AllocatorStats s = a.stats();
+    EXPECT_EQ(s.bytes_allocated, 0);
+    EXPECT_EQ(s.free_blocks, 1);
+    EXPECT_EQ(s.largest_free, s.bytes_free);
+    EXPECT_EQ(s.fragmentation, 0);
+
+    Pointer p1 = a.alloc(100);
+    Pointer p2 = a.alloc(1000);
+    Pointer p3 = a.alloc(100);
+    a.free(p2);
+    a.realloc(p3, 200);
+
+    s = a.stats();
+    EXPECT_EQ(s.allocs, 3);
+    EXPECT_EQ(s.frees, 1);
+    EXPECT_EQ(s.reallocs, 1);
+    EXPECT_EQ(s.size_histogram[6], 2);
+    EXPECT_EQ(s.size_histogram[9], 1);
+    EXPECT_EQ(s.bytes_allocated,
+        Allocator::block_size(100) + Allocator::block_size(200));
+    EXPECT_EQ(s.free_blocks, 2);
+    EXPECT_LT(s.largest_free, s.bytes_free);
+    EXPECT_GT(s.fragmentation, 0);
+
+    // A failed realloc is not counted
+    EXPECT_THROW(a.realloc(p1, sizeof(buf)), AllocError);
+    EXPECT_EQ(a.stats().reallocs, 1);
+
+    // Neither is one which does nothing or throws
+    Pointer empty;
+    a.realloc(empty, 0);
+    Pointer p4 = a.alloc(10);
+    Pointer stale = p4;
+    a.free(p4);
+    EXPECT_THROW(a.realloc(stale, 0), AllocError);
+    EXPECT_EQ(a.stats().reallocs, 1);
+
+    // Removing the largest free blocks of a size class keeps the largest
+    // free size exact, check() compares it with the arena
+    vector<Pointer> ptrs;
+    for (int i = 0; i < 12; i++) {
+        ptrs.push_back(a.alloc(300 + (i % 4) * 16));
+        ptrs.push_back(a.alloc(40));
+    }
+    for (size_t i = 0; i < ptrs.size(); i += 2) {
+        a.free(ptrs[i]);
+    }
+    EXPECT_NO_THROW(a.check());
+    for (size_t i = ptrs.size() - 2; i < ptrs.size(); i -= 2) {
+        ptrs[i] = a.alloc(300 + ((i / 2) % 4) * 16);
+        EXPECT_NO_THROW(a.check());
+    }
+    for (Pointer &p: ptrs) {
+        a.free(p);
+    }
+
+    a.free(p1);
+    a.free(p3);
+    s = a.stats();
+    EXPECT_EQ(s.bytes_allocated, 0);
+    EXPECT_EQ(s.free_blocks, 1);
+}
+
+TEST(Allocator, Batch) {
+    Allocator a(buf, sizeof(buf));
+
+    const size_t count = 50;
+    size_t size = 64;
+    Pointer ptrs[count];
+
+    a.alloc_batch(count, size, ptrs);
+    for (Pointer &p: ptrs) {
+        EXPECT_TRUE(isValidMemory(p, size));
+        writeTo(p, size);
+    }
+
+    // The batch is one contiguous area
+    char *first = reinterpret_cast<char*>(ptrs[0].get());
+    for (size_t i = 1; i < count; i++) {
+        EXPECT_EQ(
+            reinterpret_cast<char*>(ptrs[i].get()),
+            first + i * Allocator::block_size(size)
+        );
+    }
+    for (Pointer &p: ptrs) {
+        EXPECT_TRUE(isDataOk(p, size));
+    }
+
+    a.free_batch(ptrs, count);
+    for (Pointer &p: ptrs) {
+        EXPECT_EQ(p.get(), nullptr);
+    }
+    AllocatorStats s = a.stats();
+    EXPECT_EQ(s.free_blocks, 1);
+    EXPECT_EQ(s.bytes_allocated, 0);
+}
+
+TEST(Allocator, BatchNoMem) {
+    Allocator a(buf, sizeof(buf));
+
+    const size_t count = 100;
+    Pointer ptrs[count];
+
+    // Nothing is left allocated by the failed batch
+    EXPECT_THROW(a.alloc_batch(count, sizeof(buf) / 50, ptrs), AllocError);
+    for (Pointer &p: ptrs) {
+        EXPECT_EQ(p.get(), nullptr);
+    }
+    EXPECT_EQ(a.stats().bytes_allocated, 0);
+
+    // Scattered free areas still satisfy the batch
+    vector<Pointer> fill;
+    ASSERT_TRUE(fillUp(a, 200, fill));
+    for (size_t i = 0; i < fill.size(); i += 2) {
+        a.free(fill[i]);
+    }
+    a.alloc_batch(count, 200, ptrs);
+    for (Pointer &p: ptrs) {
+        writeTo(p, 200);
+    }
+    for (size_t i = 1; i < fill.size(); i += 2) {
+        EXPECT_TRUE(isDataOk(fill[i], 200));
+    }
+
+    // Invalid pointers are reported after the valid ones are freed
+    Pointer stale = ptrs[0];
+    a.free(ptrs[0]);
+    ptrs[0] = stale;
+    EXPECT_THROW(a.free_batch(ptrs, count), AllocError);
+    for (Pointer &p: ptrs) {
+        EXPECT_EQ(p.get(), nullptr);
+    }
+}
+
+static bool isAligned(Pointer &p, size_t alignment) {
+    return (reinterpret_cast<uintptr_t>(p.get()) & (alignment - 1)) == 0;
+}
+
+TEST(Allocator, AlignedAlloc) {
+    Allocator a(buf, sizeof(buf));
+
+    EXPECT_THROW(a.alloc_aligned(100, 48), AllocError);
+
+    vector<Pointer> ptrs;
+    for (size_t alignment = 16; alignment <= 4096; alignment *= 2) {
+        ptrs.push_back(a.alloc(40));
+        ptrs.push_back(a.alloc_aligned(100, alignment));
+        EXPECT_TRUE(isAligned(ptrs.back(), alignment));
+        EXPECT_TRUE(isValidMemory(ptrs.back(), 100));
+        writeTo(ptrs.back(), 100);
+    }
+
+    // The paddings are returned to the free space
+    for (Pointer &p: ptrs) {
+        a.free(p);
+    }
+    AllocatorStats s = a.stats();
+    EXPECT_EQ(s.free_blocks, 1);
+    EXPECT_EQ(s.bytes_allocated, 0);
+
+    // Runs of 32-byte aligned blocks moved by the defragmentation leave
+    // spaces smaller than a free block behind
+    minstd_rand random(7);
+    ptrs.clear();
+    for (int step = 0; step < 1000; step++) {
+        size_t op = random() % 3;
+        if ((op == 0) || ptrs.empty()) {
+            ptrs.push_back(a.alloc_aligned(16 + random() % 200, 32));
+            writeTo(ptrs.back(), 16);
+        } else if (op == 1) {
+            size_t i = random() % ptrs.size();
+            EXPECT_TRUE(isDataOk(ptrs[i], 16));
+            a.free(ptrs[i]);
+            ptrs.erase(ptrs.begin() + i);
+        } else {
+            a.defrag_step(64 + random() % 512);
+        }
+        ASSERT_NO_THROW(a.check());
+    }
+    for (Pointer &p: ptrs) {
+        EXPECT_TRUE(isAligned(p, 32));
+        EXPECT_TRUE(isDataOk(p, 16));
+        a.free(p);
+    }
+    EXPECT_EQ(a.stats().bytes_allocated, 0);
+}
+
+TEST(Allocator, AlignedDefragRealloc) {
+    Allocator a(buf, sizeof(buf));
+
+    for (int slices = 0; slices < 2; slices++) {
+        vector<Pointer> ptrs;
+        for (int i = 0; i < 40; i++) {
+            if (i % 5 == 0) {
+                ptrs.push_back(a.alloc_aligned(200, 256));
+            } else {
+                ptrs.push_back(a.alloc(40 + i * 8));
+            }
+            writeTo(ptrs.back(), 40);
+        }
+        for (size_t i = 1; i < ptrs.size(); i += 3) {
+            a.free(ptrs[i]);
+        }
+
+        if (slices) {
+            while (!a.defrag_step(256).done) {}
+        } else {
+            a.defrag();
+        }
+        for (size_t i = 0; i < ptrs.size(); i++) {
+            if (i % 3 != 1) {
+                EXPECT_TRUE(isDataOk(ptrs[i], 40));
+                if (i % 5 == 0) {
+                    EXPECT_TRUE(isAligned(ptrs[i], 256));
+                }
+            }
+        }
+
+        // Growing moves the area, the alignment is kept
+        a.realloc(ptrs[0], 8000);
+        EXPECT_TRUE(isAligned(ptrs[0], 256));
+        EXPECT_TRUE(isDataOk(ptrs[0], 40));
+
+        for (size_t i = 0; i < ptrs.size(); i++) {
+            if (i % 3 != 1) {
+                a.free(ptrs[i]);
+            }
+        }
+        EXPECT_EQ(a.stats().free_blocks, 1);
+    }
+}
+
+TEST(Allocator, PinnedDefrag) {
+    Allocator a(buf, sizeof(buf));
+
+    vector<Pointer> ptrs;
+    vector<char*> pinned;
+    for (int i = 0; i < 30; i++) {
+        ptrs.push_back(a.alloc(100));
+        writeTo(ptrs.back(), 100);
+        if (i % 4 == 0) {
+            pinned.push_back(reinterpret_cast<char*>(a.alloc_pinned(60)));
+            memset(pinned.back(), i, 60);
+        }
+    }
+    for (size_t i = 0; i < ptrs.size(); i += 2) {
+        a.free(ptrs[i]);
+    }
+
+    a.defrag();
+    while (!a.defrag_step(128).done) {}
+
+    // Pinned areas stay in place, the rest is compacted around them
+    for (size_t i = 0; i < pinned.size(); i++) {
+        for (int j = 0; j < 60; j++) {
+            EXPECT_EQ(pinned[i][j], (char)(i * 4));
+        }
+    }
+    for (size_t i = 1; i < ptrs.size(); i += 2) {
+        EXPECT_TRUE(isDataOk(ptrs[i], 100));
+    }
+
+    int x;
+    EXPECT_THROW(a.free_pinned(&x), AllocError);
+    EXPECT_THROW(a.free_pinned(ptrs[1].get()), AllocError);
+    for (char *p: pinned) {
+        a.free_pinned(p);
+    }
+    for (size_t i = 1; i < ptrs.size(); i += 2) {
+        a.free(ptrs[i]);
+    }
+    EXPECT_EQ(a.stats().free_blocks, 1);
+}
+
+struct PoolItem {
+    int value;
+    static int alive;
+    PoolItem(int v): value(v) { alive++; }
+    ~PoolItem() { alive--; }
+};
+
+int PoolItem::alive = 0;
+
+TEST(Allocator, IntegrityCheck) {
+    Allocator a(buf, sizeof(buf));
+
+    vector<Pointer> ptrs;
+    for (int i = 0; i < 20; i++) {
+        ptrs.push_back(a.alloc(50 + i * 10));
+        writeTo(ptrs.back(), 50 + i * 10);
+    }
+    for (size_t i = 0; i < ptrs.size(); i += 3) {
+        a.free(ptrs[i]);
+    }
+    void *pinned = a.alloc_pinned(100);
+    EXPECT_NO_THROW(a.check());
+
+    // Damage the size in the block header
+    size_t *tag = reinterpret_cast<size_t*>(ptrs[1].get()) - 2;
+    size_t saved = *tag;
+    *tag += 16;
+    try {
+        a.check();
+        FAIL() << "The damaged header is not detected";
+    } catch (AllocError &e) {
+        EXPECT_EQ(e.getType(), AllocErrorType::CorruptedArena);
+    }
+    *tag = saved;
+    EXPECT_NO_THROW(a.check());
+
+    a.free_pinned(pinned);
+    a.defrag();
+    EXPECT_NO_THROW(a.check());
+}
+
+#ifdef ALLOCATOR_CHECKED
+TEST(Allocator, CheckedOverrun) {
+    Allocator a(buf, sizeof(buf));
+
+    Pointer p = a.alloc(40);
+    Pointer q = p;
+    EXPECT_EQ(a.usable_size(p), 40);
+    char *area = reinterpret_cast<char*>(p.get());
+    memset(area, 1, 40);
+
+    // Freed memory is poisoned, the stale copy is caught by the generation
+    a.free(p);
+    EXPECT_EQ((unsigned char)area[39], 0xdd);
+    EXPECT_THROW(a.free(q), AllocError);
+    EXPECT_NO_THROW(a.check());
+
+    // Writing past the requested size is caught on free and by check
+    p = a.alloc(40);
+    reinterpret_cast<char*>(p.get())[40] = 1;
+    try {
+        a.check();
+        FAIL() << "The overrun is not detected";
+    } catch (AllocError &e) {
+        EXPECT_EQ(e.getType(), AllocErrorType::CorruptedArena);
+    }
+    try {
+        a.free(p);
+        FAIL() << "The overrun is not detected";
+    } catch (AllocError &e) {
+        EXPECT_EQ(e.getType(), AllocErrorType::CorruptedArena);
+    }
+}
+
+TEST(Allocator, CheckedDefragPadding) {
+    Allocator a(buf, sizeof(buf));
+
+    // Aligned blocks placed by defrag leave paddings too small to be free
+    // blocks, they join the allocated blocks before them. The redzones of
+    // those blocks move to their new ends.
+    for (unsigned seed = 1; seed <= 20; seed++) {
+        minstd_rand random(seed);
+        vector<Pointer> ptrs;
+        for (int step = 0; step < 1000; step++) {
+            size_t op = random() % 3;
+            if ((op == 0) || ptrs.empty()) {
+                size_t size = 16 + random() % 200;
+                if (random() % 4 == 0) {
+                    ptrs.push_back(a.alloc(size));
+                } else {
+                    ptrs.push_back(
+                        a.alloc_aligned(size, 16 << (random() % 5))
+                    );
+                }
+                writeTo(ptrs.back(), 16);
+            } else if (op == 1) {
+                size_t i = random() % ptrs.size();
+                EXPECT_TRUE(isDataOk(ptrs[i], 16));
+                a.free(ptrs[i]);
+                ptrs.erase(ptrs.begin() + i);
+            } else {
+                a.defrag();
+            }
+            ASSERT_NO_THROW(a.check()) << "seed " << seed;
+        }
+        for (Pointer &p: ptrs) {
+            EXPECT_TRUE(isDataOk(p, 16));
+            a.free(p);
+        }
+    }
+}
+#endif
+
+TEST(Allocator, ObjectPool) {
+    Allocator a(buf, sizeof(buf));
+
+    {
+        ObjectPool<PoolItem> pool(a, 16);
+        vector<PoolItem*> items;
+        for (int i = 0; i < 100; i++) {
+            items.push_back(pool.create(i));
+        }
+        EXPECT_EQ(PoolItem::alive, 100);
+
+        // Freed objects are reused
+        PoolItem* freed = items[10];
+        pool.destroy(freed);
+        items[10] = pool.create(10);
+        EXPECT_EQ(items[10], freed);
+
+        // Defragmentation does not move the slabs
+        Pointer p = a.alloc(1000);
+        a.free(p);
+        a.defrag();
+        for (int i = 0; i < 100; i++) {
+            EXPECT_EQ(items[i]->value, i);
+        }
+
+        for (PoolItem* item: items) {
+            pool.destroy(item);
+        }
+        EXPECT_EQ(PoolItem::alive, 0);
+    }
+
+    EXPECT_EQ(a.stats().bytes_allocated, 0);
+}
+
+TEST(Allocator, BlockPoolCrossThread) {
+    static char arena[4 * 1024 * 1024];
+    Allocator a(arena, sizeof(arena), AllocatorMode::Concurrent);
+
+    {
+        BlockPool pool(a, 40, 16);
+        EXPECT_EQ(pool.block_size(), 48);
+
+        const int threadCount = 4;
+        const int iterations = 50000;
+
+        // Blocks are swapped through the mailboxes, so every block is
+        // allocated by one thread and freed by another
+        const size_t mailboxCount = 16;
+        atomic<unsigned char*> mailboxes[mailboxCount];
+        for (atomic<unsigned char*> &m: mailboxes) {
+            m.store(nullptr);
+        }
+        atomic<int> errors(0);
+
+        auto worker = [&](int id) {
+            unsigned int state = id + 1;
+            for (int i = 0; i < iterations; i++) {
+                state = state * 1103515245 + 12345;
+                unsigned char stamp = (unsigned char)(state >> 16);
+                unsigned char* p = static_cast<unsigned char*>(
+                    pool.allocate()
+                );
+                memset(p, stamp, 40);
+
+                p = mailboxes[(state >> 8) % mailboxCount].exchange(p);
+                if (!p) {
+                    continue;
+                }
+                // Nobody else owns the block
+                for (int j = 1; j < 40; j++) {
+                    if (p[j] != p[0]) {
+                        errors++;
+                        break;
+                    }
+                }
+                pool.deallocate(p);
+            }
+        };
+
+        vector<thread> threads;
+        for (int i = 0; i < threadCount; i++) {
+            threads.push_back(thread(worker, i));
+        }
+        for (thread &t: threads) {
+            t.join();
+        }
+        EXPECT_EQ(errors, 0);
+
+        for (atomic<unsigned char*> &m: mailboxes) {
+            if (m.load()) {
+                pool.deallocate(m.load());
+            }
+        }
+
+        // All the blocks are back and distinct
+        size_t capacity = pool.capacity();
+        set<void*> blocks;
+        for (size_t i = 0; i < capacity; i++) {
+            blocks.insert(pool.allocate());
+        }
+        EXPECT_EQ(blocks.size(), capacity);
+        EXPECT_EQ(pool.capacity(), capacity);
+
+        int x;
+        EXPECT_THROW(pool.deallocate(&x), AllocError);
+        EXPECT_THROW(
+            pool.deallocate(static_cast<char*>(*blocks.begin()) + 8),
+            AllocError
+        );
+    }
+
+    EXPECT_EQ(a.stats().bytes_allocated, 0);
+}
+
+typedef unordered_map<int, int, hash<int>, equal_to<int>,
+    ArenaAllocator<pair<const int, int>>> ArenaMap;
+
+TEST(Allocator, ArenaContainers) {
+    Allocator a(buf, sizeof(buf));
+
+    typedef basic_string<char, char_traits<char>, ArenaAllocator<char>>
+        ArenaString;
+    {
+        vector<int, ArenaAllocator<int>> v{ArenaAllocator<int>(a)};
+        ArenaMap m(16, hash<int>(), equal_to<int>(), ArenaAllocator<int>(a));
+        ArenaString str("arena", ArenaAllocator<char>(a));
+
+        Pointer p = a.alloc(500);
+        for (int i = 0; i < 200; i++) {
+            v.push_back(i);
+            m[i] = 2 * i;
+            str += 'x';
+        }
+
+        // Containers keep working across defrag of the movable areas
+        a.free(p);
+        a.defrag();
+        for (int i = 0; i < 200; i++) {
+            EXPECT_EQ(v[i], i);
+            EXPECT_EQ(m[i], 2 * i);
+        }
+        EXPECT_EQ(str.size(), 205);
+        EXPECT_EQ(str.compare(0, 5, "arena"), 0);
+
+        EXPECT_THROW(v.resize(sizeof(buf)), bad_alloc);
+    }
+    EXPECT_EQ(a.stats().bytes_allocated, 0);
+}
+
+TEST(Allocator, MonotonicArena) {
+    Allocator a(buf, sizeof(buf));
+
+    MonotonicArena arena(a, 4096);
+    {
+        ArenaAllocator<int> alloc(arena);
+        vector<int, ArenaAllocator<int>> v(alloc);
+        ArenaMap m(16, hash<int>(), equal_to<int>(), alloc);
+        for (int i = 0; i < 300; i++) {
+            v.push_back(i);
+            m[i] = i;
+        }
+        for (int i = 0; i < 300; i++) {
+            EXPECT_EQ(v[i], i);
+            EXPECT_EQ(m[i], i);
+        }
+        EXPECT_GT(a.stats().bytes_allocated, 300 * sizeof(int));
+    }
+
+    // Deallocation does nothing, the memory is released at once
+    EXPECT_GT(a.stats().bytes_allocated, 0);
+    arena.release();
+    EXPECT_EQ(a.stats().bytes_allocated, 0);
+}
+
+TEST(Allocator, InArenaReattach) {
+    vector<Pointer> ptrs;
+    {
+        Allocator a(buf, sizeof(buf), AllocatorMode::SingleThreaded,
+            AllocatorStorage::Arena);
+        for (int i = 0; i < 20; i++) {
+            ptrs.push_back(a.alloc(100 + i));
+            writeTo(ptrs.back(), 100 + i);
+        }
+        a.free(ptrs[3]);
+        a.set_root(ptrs[5]);
+    }
+
+    // The state is found in the arena, nothing is rebuilt
+    Allocator a(buf, sizeof(buf), AllocatorMode::SingleThreaded,
+        AllocatorStorage::Arena);
+    Pointer root = a.root();
+    ASSERT_NE(root.get(), nullptr);
+    EXPECT_TRUE(isDataOk(root, 105));
+    a.free(root);
+    EXPECT_EQ(a.root().get(), nullptr);
+
+    // The arena keeps working after the reattachment
+    vector<Pointer> more;
+    EXPECT_TRUE(fillUp(a, 300, more));
+    for (Pointer &p: more) {
+        EXPECT_TRUE(isDataOk(p, 300));
+        a.free(p);
+    }
+
+    // The arena must not be mistaken for the one with another size
+    EXPECT_THROW(Allocator(buf, sizeof(buf) / 2, AllocatorMode::SingleThreaded,
+        AllocatorStorage::Arena), AllocError);
+    memset(buf, 0, sizeof(buf));
+}
+
+TEST(Allocator, MappedArena) {
+    string path = "/tmp/allocator_test_arena." + to_string(getpid());
+    unlink(path.c_str());
+    {
+        MappedArena arena(path, 1 << 20);
+        EXPECT_FALSE(arena.reattached());
+        Pointer p = arena.allocator().alloc(1000);
+        writeTo(p, 1000);
+        arena.allocator().set_root(p);
+
+        // Only one user of the file at a time
+        EXPECT_THROW(MappedArena(path, 1 << 20), AllocError);
+    }
+    {
+        MappedArena arena(path, 1 << 20);
+        EXPECT_TRUE(arena.reattached());
+        Pointer p = arena.allocator().root();
+        ASSERT_NE(p.get(), nullptr);
+        EXPECT_TRUE(isDataOk(p, 1000));
+        arena.allocator().realloc(p, 100000);
+        EXPECT_TRUE(isDataOk(p, 1000));
+    }
+    unlink(path.c_str());
+}
+
+TEST(Allocator, RegionGrowth) {
+    RegionAllocator a(65536, 1);
+
+    // Regions are added when the existing ones are full
+    vector<Pointer> ptrs;
+    for (int i = 0; i < 1000; i++) {
+        ptrs.push_back(a.alloc(300));
+        writeTo(ptrs.back(), 300);
+    }
+    EXPECT_GT(a.region_count(), 1);
+    for (Pointer &p: ptrs) {
+        EXPECT_TRUE(isDataOk(p, 300));
+    }
+
+    // The area which outgrows its region moves to a new one
+    a.realloc(ptrs[0], 200000);
+    EXPECT_TRUE(isDataOk(ptrs[0], 300));
+
+    // Releasing free pages keeps the live data
+    for (size_t i = 2; i < ptrs.size(); i += 2) {
+        a.free(ptrs[i]);
+    }
+    a.defrag();
+    a.trim();
+    for (size_t i = 3; i < ptrs.size(); i += 2) {
+        EXPECT_TRUE(isDataOk(ptrs[i], 300));
+    }
+
+    Pointer stale = ptrs[1];
+    a.free(ptrs[1]);
+    EXPECT_THROW(a.free(stale), AllocError);
+    EXPECT_EQ(stale.get(), nullptr);
+
+    // Pointers of another allocator are rejected without touching it
+    Allocator plain(buf, sizeof(buf));
+    Pointer foreign = plain.alloc(100);
+    try {
+        a.free(foreign);
+        FAIL() << "The foreign pointer is freed";
+    } catch (AllocError &e) {
+        EXPECT_EQ(e.getType(), AllocErrorType::InvalidFree);
+    }
+    EXPECT_THROW(a.realloc(foreign, 200), AllocError);
+    EXPECT_TRUE(isValidMemory(foreign, 100));
+    plain.free(foreign);
+
+    // Emptied regions are unmapped except the spare one
+    for (Pointer &p: ptrs) {
+        if (p.get()) {
+            a.free(p);
+        }
+    }
+    EXPECT_EQ(a.region_count(), 1);
+
+    Pointer p = a.alloc(100);
+    writeTo(p, 100);
+    EXPECT_TRUE(isDataOk(p, 100));
+    a.free(p);
+}
+
+TEST(Allocator, SharedArena) {
+    string name = "/allocator_test_shared." + to_string(getpid());
+    SharedArena::remove(name);
+
+    SharedArena arena(name, 1 << 20);
+    EXPECT_TRUE(arena.created());
+    Allocator &a = arena.allocator();
+
+    // The handle table lives in the arena too
+    Pointer first = a.alloc(1);
+    a.free(first);
+    size_t tableBytes = a.stats().bytes_allocated;
+
+    // The root keeps a handle table the processes exchange values through
+    Pointer table = a.alloc(2 * sizeof(uint64_t));
+    uint64_t *handles = reinterpret_cast<uint64_t*>(table.get());
+    Pointer value = a.alloc(500);
+    writeTo(value, 500);
+    handles[0] = a.to_handle(value);
+    handles[1] = 0;
+    a.set_root(table);
+
+    const int ops = 20000;
+    pid_t child = fork();
+    if (child == 0) {
+        // Only _exit is safe in the child of the test process
+        int failed = 0;
+        {
+            SharedArena other(name, 1 << 20);
+            Allocator &b = other.allocator();
+            uint64_t *h = reinterpret_cast<uint64_t*>(b.root().get());
+            Pointer v = b.from_handle(h[0]);
+            failed += (other.created() || !isDataOk(v, 500)) ? 1 : 0;
+
+            Pointer reply = b.alloc(300);
+            writeTo(reply, 300);
+            h[1] = b.to_handle(reply);
+
+            for (int i = 0; i < ops; i++) {
+                Pointer p = b.alloc(16 + i % 200);
+                b.free(p);
+            }
+        }
+        _exit(failed);
+    }
+
+    // Both processes hit the arena at the same time
+    vector<Pointer> ptrs;
+    for (int i = 0; i < ops; i++) {
+        ptrs.push_back(a.alloc(16 + i % 100));
+        if (ptrs.size() > 50) {
+            a.free(ptrs.front());
+            ptrs.erase(ptrs.begin());
+        }
+    }
+    for (Pointer &p: ptrs) {
+        a.free(p);
+    }
+
+    int status;
+    ASSERT_EQ(waitpid(child, &status, 0), child);
+    EXPECT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), 0);
+
+    Pointer reply = a.from_handle(handles[1]);
+    ASSERT_NE(reply.get(), nullptr);
+    EXPECT_TRUE(isDataOk(reply, 300));
+
+    a.free(reply);
+    a.free(value);
+    EXPECT_EQ(a.from_handle(handles[0]).get(), nullptr);
+    a.free(table);
+    EXPECT_EQ(a.stats().bytes_allocated, tableBytes);
+
+    SharedArena::remove(name);
+}
+
+TEST(Allocator, SharedArenaFreeDefrag) {
+    string name = "/allocator_test_defrag." + to_string(getpid());
+    SharedArena::remove(name);
+
+    SharedArena arena(name, 256 * 1024);
+    Allocator &a = arena.allocator();
+    Pointer first = a.alloc(1);
+    a.free(first);
+    size_t tableBytes = a.stats().bytes_allocated;
+
+    // The child allocates and frees while the parent compacts the arena
+    pid_t child = fork();
+    if (child == 0) {
+        int failed = 0;
+        {
+            SharedArena other(name, 256 * 1024);
+            Allocator &b = other.allocator();
+            minstd_rand random(1);
+            vector<Pointer> live;
+            for (int i = 0; i < 1000000; i++) {
+                try {
+                    live.push_back(b.alloc(1 + random() % 2000));
+                } catch (AllocError &) {
+                    // The arena is exhausted, continue with frees
+                }
+                if ((live.size() > 30) || ((random() % 2) && !live.empty())) {
+                    size_t index = random() % live.size();
+                    b.free(live[index]);
+                    live.erase(live.begin() + index);
+                }
+            }
+            for (Pointer &p: live) {
+                b.free(p);
+            }
+            try {
+                b.check();
+            } catch (AllocError &) {
+                failed = 1;
+            }
+        }
+        _exit(failed);
+    }
+
+    int status;
+    int slices = 0;
+    while (waitpid(child, &status, WNOHANG) == 0) {
+        if (slices++ % 2) {
+            a.defrag_step(4096);
+        } else {
+            a.defrag();
+        }
+    }
+    EXPECT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), 0);
+
+    EXPECT_NO_THROW(a.check());
+    EXPECT_EQ(a.stats().bytes_allocated, tableBytes);
+
+    SharedArena::remove(name);
+}
+
+TEST(Allocator, HugePageArena) {
+    const HugePages backings[] = {
+        HugePages::Regular, HugePages::Transparent, HugePages::Explicit
+    };
+    for (HugePages pages: backings) {
+        HugePageArena arena(3 * 1024 * 1024, 0, pages);
+        EXPECT_EQ(arena.arena_size(), 2 * HugePageArena::HUGE_PAGE);
+
+        // Falls back to a lesser backing, never to a better one
+        EXPECT_LE((int)arena.pages(), (int)pages);
+
+        Allocator &a = arena.allocator();
+        Pointer p = a.alloc(1024 * 1024);
+        writeTo(p, 1024 * 1024);
+        EXPECT_TRUE(isDataOk(p, 1024 * 1024));
+        a.free(p);
+    }
+}
+
+TEST(Allocator, NumaArenas) {
+    NumaArenas arenas(4 * 1024 * 1024);
+    ASSERT_GE(arenas.node_count(), 1);
+
+    // Every thread draws from the arena of its node
+    vector<thread> threads;
+    atomic<int> errors(0);
+    for (int i = 0; i < 4; i++) {
+        threads.push_back(thread([&arenas, &errors]() {
+            Allocator &a = arenas.local();
+            for (int j = 0; j < 1000; j++) {
+                Pointer p = a.alloc(16 + j % 200);
+                writeTo(p, 16 + j % 200);
+                if (!isDataOk(p, 16 + j % 200)) {
+                    errors++;
+                }
+                a.free(p);
+            }
+        }));
+    }
+    for (thread &t: threads) {
+        t.join();
+    }
+    EXPECT_EQ(errors, 0);
+
+    for (size_t i = 0; i < arenas.node_count(); i++) {
+        EXPECT_EQ(arenas.node(i).stats().bytes_allocated, 0);
+    }
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+#include "allocator.hpp"
+
+#include <cstddef>
+#include <new>
+
+/**
+  * @brief Bump allocator over chunks pinned in the Allocator arena. Memory
+  * is never freed one by one, everything is released at once with release()
+  * or when the arena is destroyed.
+  *
+  * The arena is not thread-safe.
+  */
+class MonotonicArena {
+public:
+    /** @arg allocator - allocator to take chunks from.
+      * @arg chunk_size - size of a regular chunk. Larger requests get a
+      * chunk of their own.
+      */
+    explicit MonotonicArena(Allocator &allocator, size_t chunk_size = 65536):
+        allocator(allocator),
+        chunk_size(chunk_size),
+        chunks(nullptr),
+        current(nullptr),
+        end(nullptr)
+    {}
+
+    MonotonicArena(const MonotonicArena&) = delete;
+    MonotonicArena& operator=(const MonotonicArena&) = delete;
+
+    ~MonotonicArena() {
+        this->release();
+    }
+
+    /** Returns the memory of the specified size and alignment.
+      * @throw AllocError if there is no room for a new chunk.
+      */
+    void *allocate(size_t bytes, size_t alignment) {
+        unsigned char* p = this->alignUp(this->current, alignment);
+        if (!p || (p > this->end) || (bytes > (size_t)(this->end - p))) {
+            this->addChunk(bytes + alignment);
+            p = this->alignUp(this->current, alignment);
+        }
+        this->current = p + bytes;
+        return p;
+    }
+
+    /** Returns all the chunks to the allocator. */
+    void release() {
+        while (this->chunks) {
+            Chunk* next = this->chunks->next;
+            this->allocator.free_pinned(this->chunks);
+            this->chunks = next;
+        }
+        this->current = nullptr;
+        this->end = nullptr;
+    }
+
+private:
+    /** Chunk header followed by the memory handed out. */
+    struct Chunk {
+        Chunk* next;
+    };
+
+    static unsigned char* alignUp(unsigned char* p, size_t alignment) {
+        uintptr_t value = reinterpret_cast<uintptr_t>(p);
+        value = (value + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        return reinterpret_cast<unsigned char*>(value);
+    }
+
+    void addChunk(size_t bytes) {
+        size_t size = sizeof(Chunk) + bytes;
+        if (size < this->chunk_size) {
+            size = this->chunk_size;
+        }
+        unsigned char* raw = static_cast<unsigned char*>(
+            this->allocator.alloc_pinned(size)
+        );
+        Chunk* chunk = reinterpret_cast<Chunk*>(raw);
+        chunk->next = this->chunks;
+        this->chunks = chunk;
+        this->current = raw + sizeof(Chunk);
+        this->end = raw + size;
+    }
+
+    Allocator& allocator;
+    size_t chunk_size;
+    Chunk* chunks;
+    /** Free space of the latest chunk. */
+    unsigned char* current;
+    unsigned char* end;
+};
+
+/**
+  * @brief Standard allocator drawing memory from the Allocator arena, e.g.
+  * for std::vector, std::unordered_map or std::basic_string.
+  *
+  * Containers keep plain pointers, so the memory is allocated pinned:
+  * defrag leaves it in place and compacts the movable areas around it. With
+  * a MonotonicArena deallocation does nothing and the memory of all the
+  * containers is released at once.
+  */
+template <typename T>
+class ArenaAllocator {
+
+template <typename U>
+friend class ArenaAllocator;
+
+public:
+    typedef T value_type;
+
+    /** Allocates every object from the allocator and frees it on
+      * deallocation.
+      */
+    ArenaAllocator(Allocator &allocator) noexcept:
+        allocator(&allocator), monotonic(nullptr)
+    {}
+
+    /** Allocates from the monotonic arena, deallocation does nothing. */
+    ArenaAllocator(MonotonicArena &monotonic) noexcept:
+        allocator(nullptr), monotonic(&monotonic)
+    {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) noexcept:
+        allocator(other.allocator), monotonic(other.monotonic)
+    {}
+
+    T* allocate(size_t n) {
+        static_assert(
+            alignof(T) <= 16,
+            "Arena memory is aligned to 16 bytes, the type alignment is larger"
+        );
+        if (n > (size_t)-1 / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+        try {
+            if (this->monotonic) {
+                return static_cast<T*>(
+                    this->monotonic->allocate(n * sizeof(T), alignof(T))
+                );
+            }
+            return static_cast<T*>(this->allocator->alloc_pinned(n * sizeof(T)));
+        } catch (AllocError &) {
+            throw std::bad_alloc();
+        }
+    }
+
+    void deallocate(T* p, size_t) {
+        if (p && !this->monotonic) {
+            this->allocator->free_pinned(p);
+        }
+    }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> &other) const noexcept {
+        return (this->allocator == other.allocator) &&
+            (this->monotonic == other.monotonic);
+    }
+
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U> &other) const noexcept {
+        return !(*this == other);
+    }
+
+private:
+    Allocator* allocator;
+    MonotonicArena* monotonic;
+};
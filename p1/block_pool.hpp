@@ -0,0 +1,238 @@
+#pragma once
+
+#include "allocator.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+/**
+  * @brief Lock-free pool of fixed-size blocks carved from slabs pinned in
+  * the Allocator arena. Any thread may allocate and any thread may free, so
+  * a block allocated by a producer is freed by a consumer with one CAS.
+  *
+  * Free blocks form a Treiber stack of block indices. The head keeps the
+  * index together with a tag incremented on every change, so a head popped
+  * and pushed back by other threads in between is not mistaken for the
+  * unchanged one. The links are kept in a table beside the blocks: freed
+  * memory is not read by the pool, and a thread holding a stale head reads
+  * a stale link rather than the data of a reused block.
+  *
+  * Slab k holds blocks_per_slab << k blocks, so a few slabs cover any
+  * number of blocks and the slab of a block is found by its index. Only
+  * adding a slab takes a lock. The allocator has to be in the concurrent
+  * mode if other threads use it directly.
+  */
+class BlockPool {
+public:
+    /** @arg allocator - allocator to carve slabs from.
+      * @arg block_size - size of every block, rounded up to 16 bytes.
+      * @arg blocks_per_slab - number of blocks in the first slab.
+      */
+    BlockPool(
+        Allocator &allocator, size_t block_size, size_t blocks_per_slab = 256
+    ):
+        allocator(allocator),
+        stride(((block_size ? block_size : 1) + 15) & ~(size_t)15),
+        per_slab(blocks_per_slab ? blocks_per_slab : 1),
+        head(tagged(0, NIL)),
+        slab_count(0)
+    {
+        for (size_t k = 0; k < MAX_SLABS; k++) {
+            this->slabs[k].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    BlockPool(const BlockPool&) = delete;
+    BlockPool& operator=(const BlockPool&) = delete;
+
+    /** Returns all the slabs to the arena. */
+    ~BlockPool() {
+        size_t count = this->slab_count.load(std::memory_order_relaxed);
+        for (size_t k = 0; k < count; k++) {
+            this->allocator.free_pinned(
+                this->slabs[k].load(std::memory_order_relaxed)
+            );
+        }
+    }
+
+    /** Returns a block.
+      * @throw AllocError if there is no room for a new slab.
+      */
+    void *allocate() {
+        uint32_t index = this->pop();
+        while (index == NIL) {
+            this->addSlab();
+            index = this->pop();
+        }
+        return this->address(index);
+    }
+
+    /** Returns the block obtained with allocate to the pool. May be called
+      * by any thread.
+      * @throw AllocError if the block does not belong to the pool.
+      */
+    void deallocate(void *p) {
+        uint32_t index = this->indexOf(static_cast<unsigned char*>(p));
+        this->push(index, index);
+    }
+
+    /** Size of every block. */
+    size_t block_size() const {
+        return this->stride;
+    }
+
+    /** Number of blocks carved from the arena, free ones included. */
+    size_t capacity() const {
+        return this->firstIndex(
+            this->slab_count.load(std::memory_order_acquire)
+        );
+    }
+
+private:
+    /** Index of no block, ends the free list. */
+    static const uint32_t NIL = (uint32_t)-1;
+    /** Slab k holds per_slab << k blocks. */
+    static const size_t MAX_SLABS = 32;
+
+    /** Returns the stack head value for the tag and the block index. */
+    static uint64_t tagged(uint32_t tag, uint32_t index) {
+        return ((uint64_t)tag << 32) | index;
+    }
+
+    /** Returns the index of the first block of slab k. */
+    size_t firstIndex(size_t k) const {
+        return this->per_slab * (((size_t)1 << k) - 1);
+    }
+
+    /** Returns the bytes taken by the link table of slab k, the blocks
+      * follow it.
+      */
+    size_t linkBytes(size_t k) const {
+        return ((this->per_slab << k) * sizeof(std::atomic<uint32_t>) + 15) &
+            ~(size_t)15;
+    }
+
+    /** Returns the slab of the block. */
+    size_t slabOf(uint32_t index) const {
+        size_t n = index / this->per_slab + 1;
+        return 8 * sizeof(unsigned long long) - 1 - __builtin_clzll(n);
+    }
+
+    /** Returns the free list link of the block. */
+    std::atomic<uint32_t>* links(uint32_t index) const {
+        size_t k = this->slabOf(index);
+        unsigned char* slab = this->slabs[k].load(std::memory_order_acquire);
+        return reinterpret_cast<std::atomic<uint32_t>*>(slab) +
+            (index - this->firstIndex(k));
+    }
+
+    void *address(uint32_t index) const {
+        size_t k = this->slabOf(index);
+        unsigned char* slab = this->slabs[k].load(std::memory_order_acquire);
+        return slab + this->linkBytes(k) +
+            (index - this->firstIndex(k)) * this->stride;
+    }
+
+    /** Returns the index of the block by its address. The slabs only grow,
+      * so the few of them are searched without a lock.
+      */
+    uint32_t indexOf(unsigned char* p) const {
+        size_t count = this->slab_count.load(std::memory_order_acquire);
+        for (size_t k = 0; k < count; k++) {
+            unsigned char* blocks = this->slabs[k].load(
+                std::memory_order_relaxed
+            ) + this->linkBytes(k);
+            size_t offset = p - blocks;
+            if (
+                (p >= blocks) && (offset < (this->per_slab << k) * this->stride)
+                && (offset % this->stride == 0)
+            ) {
+                return (uint32_t)(this->firstIndex(k) + offset / this->stride);
+            }
+        }
+        throw AllocError(
+            AllocErrorType::InvalidFree,
+            "Unable to free. The block does not belong to the pool."
+        );
+    }
+
+    /** Pushes the chain of blocks linked from first to last. The link of
+      * last is overwritten.
+      */
+    void push(uint32_t first, uint32_t last) {
+        std::atomic<uint32_t>* link = this->links(last);
+        uint64_t old = this->head.load(std::memory_order_relaxed);
+        do {
+            link->store((uint32_t)old, std::memory_order_relaxed);
+        } while (!this->head.compare_exchange_weak(
+            old, tagged((uint32_t)(old >> 32) + 1, first),
+            std::memory_order_release, std::memory_order_relaxed
+        ));
+    }
+
+    /** Pops a block or returns NIL if the pool is empty. */
+    uint32_t pop() {
+        uint64_t old = this->head.load(std::memory_order_acquire);
+        while ((uint32_t)old != NIL) {
+            uint32_t next = this->links((uint32_t)old)->load(
+                std::memory_order_relaxed
+            );
+            if (this->head.compare_exchange_weak(
+                old, tagged((uint32_t)(old >> 32) + 1, next),
+                std::memory_order_acquire, std::memory_order_acquire
+            )) {
+                return (uint32_t)old;
+            }
+        }
+        return NIL;
+    }
+
+    /** Carves the next slab and pushes all its blocks at once. Threads
+      * which find the pool empty at the same time add one slab.
+      */
+    void addSlab() {
+        std::lock_guard<std::mutex> guard(this->grow_lock);
+        if ((uint32_t)this->head.load(std::memory_order_acquire) != NIL) {
+            return;
+        }
+
+        size_t k = this->slab_count.load(std::memory_order_relaxed);
+        size_t count = this->per_slab << k;
+        if ((k == MAX_SLABS) || (this->firstIndex(k + 1) >= NIL)) {
+            throw AllocError(
+                AllocErrorType::NoMemory,
+                "Unable to grow the pool. The block index is exhausted."
+            );
+        }
+        unsigned char* slab = static_cast<unsigned char*>(
+            this->allocator.alloc_pinned(
+                this->linkBytes(k) + count * this->stride
+            )
+        );
+
+        // Link the blocks in the address order
+        std::atomic<uint32_t>* links =
+            reinterpret_cast<std::atomic<uint32_t>*>(slab);
+        uint32_t first = (uint32_t)this->firstIndex(k);
+        for (size_t i = 0; i < count; i++) {
+            new (&links[i]) std::atomic<uint32_t>(first + (uint32_t)i + 1);
+        }
+        this->slabs[k].store(slab, std::memory_order_release);
+        this->slab_count.store(k + 1, std::memory_order_release);
+        this->push(first, first + (uint32_t)count - 1);
+    }
+
+    Allocator& allocator;
+    /** Block size rounded up to 16 bytes. */
+    size_t stride;
+    size_t per_slab;
+    /** Tag in the high half, index of the top free block in the low half. */
+    std::atomic<uint64_t> head;
+    std::atomic<unsigned char*> slabs[MAX_SLABS];
+    std::atomic<size_t> slab_count;
+    /** Serializes adding slabs. */
+    std::mutex grow_lock;
+};
@@ -0,0 +1,80 @@
+#include "mapped_arena.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Returns the error with the description of errno appended. */
+static AllocError mappingError(const std::string &message)
+{
+    return AllocError(
+        AllocErrorType::InvalidArena, message + ": " + strerror(errno)
+    );
+}
+
+MappedArena::MappedArena(
+    const std::string &path, size_t size, AllocatorMode mode
+):
+    fd(-1), base(MAP_FAILED), size(size), arena_allocator(nullptr),
+    was_reattached(false)
+{
+    try {
+        this->fd = open(path.c_str(), O_RDWR | O_CREAT, 0666);
+        if (this->fd == -1) {
+            throw mappingError("Unable to open the arena file " + path);
+        }
+        if (flock(this->fd, LOCK_EX | LOCK_NB) == -1) {
+            throw mappingError("Unable to lock the arena file " + path);
+        }
+
+        // The existing arena keeps its size
+        struct stat st;
+        if (fstat(this->fd, &st) == -1) {
+            throw mappingError("Unable to stat the arena file " + path);
+        }
+        if (st.st_size > 0) {
+            this->size = st.st_size;
+            this->was_reattached = true;
+        } else if (ftruncate(this->fd, this->size) == -1) {
+            throw mappingError("Unable to resize the arena file " + path);
+        }
+
+        this->base = mmap(
+            nullptr, this->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            this->fd, 0
+        );
+        if (this->base == MAP_FAILED) {
+            throw mappingError("Unable to map the arena file " + path);
+        }
+
+        this->arena_allocator = new Allocator(
+            this->base, this->size, mode, AllocatorStorage::Arena
+        );
+    } catch (...) {
+        if (this->base != MAP_FAILED) {
+            munmap(this->base, this->size);
+        }
+        if (this->fd != -1) {
+            close(this->fd);
+        }
+        throw;
+    }
+}
+
+MappedArena::~MappedArena()
+{
+    delete this->arena_allocator;
+    this->sync();
+    munmap(this->base, this->size);
+    close(this->fd);
+}
+
+void MappedArena::sync()
+{
+    msync(this->base, this->size, MS_SYNC);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "allocator.hpp"
+
+#include <cstddef>
+#include <string>
+
+/**
+  * @brief Allocator arena backed by a memory-mapped file. The allocator state
+  * is kept in the file, so a restarted process reattaches to the arena and
+  * its data in O(1) instead of rebuilding them. Use Allocator::set_root and
+  * Allocator::root to find the data after the restart.
+  *
+  * The file is locked while it is mapped: only one process may use the
+  * arena at a time. The arena survives a clean shutdown; a crash in the
+  * middle of an allocator call may leave the state inconsistent.
+  */
+class MappedArena {
+public:
+    /** Maps the arena file. Creates the file of the specified size if it
+      * does not exist or is empty, otherwise reattaches to the arena kept
+      * in it.
+      * @throw AllocError if the file cannot be mapped or holds a different
+      * arena.
+      */
+    MappedArena(
+        const std::string &path, size_t size,
+        AllocatorMode mode = AllocatorMode::SingleThreaded
+    );
+    /** Flushes the arena to the file and unmaps it. */
+    ~MappedArena();
+
+    MappedArena(const MappedArena&) = delete;
+    MappedArena& operator=(const MappedArena&) = delete;
+
+    Allocator& allocator() { return *this->arena_allocator; }
+    /** Whether the arena existed before and has been reattached. */
+    bool reattached() const { return this->was_reattached; }
+    /** Writes the arena to the file. */
+    void sync();
+
+private:
+    int fd;
+    void *base;
+    size_t size;
+    Allocator* arena_allocator;
+    bool was_reattached;
+};
@@ -0,0 +1,201 @@
+#include "numa_arena.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/** Binds the memory range to the node. The range must not be touched yet.
+  * libnuma is not required: mbind is called directly.
+  * @return False if the kernel does not support the binding.
+  */
+static bool bindToNode(void *base, size_t size, int node)
+{
+    const size_t bits = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> mask(node / bits + 1, 0);
+    mask[node / bits] |= 1UL << (node % bits);
+
+    // The kernel takes one bit less than maxnode
+    long result = syscall(
+        SYS_mbind, base, size, MPOL_BIND, mask.data(),
+        mask.size() * bits + 1, 0
+    );
+    return result == 0;
+}
+
+/** Maps the anonymous memory aligned to the huge page.
+  * @return MAP_FAILED if the memory cannot be mapped.
+  */
+static void *mapAligned(size_t size)
+{
+    const size_t align = HugePageArena::HUGE_PAGE;
+    unsigned char* raw = static_cast<unsigned char*>(mmap(
+        nullptr, size + align, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+    ));
+    if (raw == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+
+    // Trim the unaligned head and the rest of the tail
+    uintptr_t value = reinterpret_cast<uintptr_t>(raw);
+    unsigned char* base = reinterpret_cast<unsigned char*>(
+        (value + align - 1) & ~(uintptr_t)(align - 1)
+    );
+    if (base > raw) {
+        munmap(raw, base - raw);
+    }
+    munmap(base + size, raw + align - base);
+    return base;
+}
+
+HugePageArena::HugePageArena(
+    size_t size, int node, HugePages pages, AllocatorMode mode
+):
+    base(MAP_FAILED),
+    size((size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1)),
+    arena_allocator(nullptr),
+    backing(HugePages::Regular),
+    bound_node(-1)
+{
+    if (pages == HugePages::Explicit) {
+        this->base = mmap(
+            nullptr, this->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0
+        );
+        if (this->base != MAP_FAILED) {
+            this->backing = HugePages::Explicit;
+        }
+    }
+
+    if (this->base == MAP_FAILED) {
+        this->base = mapAligned(this->size);
+        if (this->base == MAP_FAILED) {
+            throw AllocError(
+                AllocErrorType::NoMemory,
+                std::string("Unable to map the arena: ") + strerror(errno)
+            );
+        }
+        if (
+            (pages != HugePages::Regular) &&
+            (madvise(this->base, this->size, MADV_HUGEPAGE) == 0)
+        ) {
+            this->backing = HugePages::Transparent;
+        }
+    }
+
+    // Bind before the allocator touches the first page
+    if ((node >= 0) && bindToNode(this->base, this->size, node)) {
+        this->bound_node = node;
+    }
+
+    try {
+        this->arena_allocator = new Allocator(this->base, this->size, mode);
+    } catch (...) {
+        munmap(this->base, this->size);
+        throw;
+    }
+}
+
+HugePageArena::~HugePageArena()
+{
+    delete this->arena_allocator;
+    munmap(this->base, this->size);
+}
+
+std::vector<int> NumaArenas::online_nodes()
+{
+    // Nodes without memory have nothing to bind to
+    std::ifstream list("/sys/devices/system/node/has_memory");
+    if (!list) {
+        list.open("/sys/devices/system/node/online");
+    }
+    std::string ranges;
+    std::vector<int> nodes;
+    if (!std::getline(list, ranges)) {
+        return nodes;
+    }
+
+    // The list looks like "0-3,5"
+    std::istringstream fields(ranges);
+    std::string range;
+    while (std::getline(fields, range, ',')) {
+        int first = 0, last = 0;
+        char dash = 0;
+        std::istringstream bounds(range);
+        bounds >> first;
+        if (!bounds) {
+            return std::vector<int>();
+        }
+        last = first;
+        if (bounds >> dash >> last) {
+            if ((dash != '-') || (last < first)) {
+                return std::vector<int>();
+            }
+        }
+        for (int node = first; node <= last; node++) {
+            nodes.push_back(node);
+        }
+    }
+    return nodes;
+}
+
+NumaArenas::NumaArenas(size_t size_per_node, HugePages pages)
+{
+    std::vector<int> nodes = online_nodes();
+    try {
+        if (nodes.size() < 2) {
+            this->arenas.push_back(new HugePageArena(
+                size_per_node, -1, pages, AllocatorMode::Concurrent
+            ));
+            return;
+        }
+        for (int node: nodes) {
+            if ((size_t)node >= this->by_node.size()) {
+                this->by_node.resize(node + 1, 0);
+            }
+            this->by_node[node] = this->arenas.size();
+            this->arenas.push_back(new HugePageArena(
+                size_per_node, node, pages, AllocatorMode::Concurrent
+            ));
+        }
+    } catch (...) {
+        for (HugePageArena* arena: this->arenas) {
+            delete arena;
+        }
+        throw;
+    }
+}
+
+NumaArenas::~NumaArenas()
+{
+    for (HugePageArena* arena: this->arenas) {
+        delete arena;
+    }
+}
+
+Allocator& NumaArenas::local()
+{
+    // The node is looked up once per thread: getcpu is a system call
+    static thread_local int threadNode = -1;
+    if (threadNode < 0) {
+        unsigned int cpu = 0, node = 0;
+        if (syscall(SYS_getcpu, &cpu, &node, nullptr) == -1) {
+            node = 0;
+        }
+        threadNode = (int)node;
+    }
+
+    size_t index = 0;
+    if ((size_t)threadNode < this->by_node.size()) {
+        index = this->by_node[threadNode];
+    }
+    return this->arenas[index]->allocator();
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "allocator.hpp"
+
+#include <cstddef>
+#include <vector>
+
+enum class HugePages {
+    /** Regular pages of the OS. */
+    Regular,
+    /** Transparent huge pages requested with madvise. The kernel may back
+      * the arena with regular pages when it has no huge ones at hand.
+      */
+    Transparent,
+    /** Huge pages reserved by the administrator, mapped with MAP_HUGETLB. */
+    Explicit,
+};
+
+/**
+  * @brief Anonymous arena backed by huge pages and bound to a NUMA node.
+  * The arena is mapped with the best backing available up to the requested
+  * one: explicit huge pages fall back to transparent ones, those fall back
+  * to regular pages. Binding to the node is skipped when the kernel does not
+  * support it.
+  */
+class HugePageArena {
+public:
+    /** Size of the huge page the arena is aligned and rounded to. */
+    static const size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+    /** @arg size - arena size, rounded up to HUGE_PAGE.
+      * @arg node - NUMA node to place the arena on, -1 for any.
+      * @arg pages - the preferred backing.
+      * @arg mode - mode of the arena allocator.
+      * @throw AllocError if the arena cannot be mapped.
+      */
+    explicit HugePageArena(
+        size_t size, int node = -1, HugePages pages = HugePages::Transparent,
+        AllocatorMode mode = AllocatorMode::SingleThreaded
+    );
+    /** Unmaps the arena. */
+    ~HugePageArena();
+
+    HugePageArena(const HugePageArena&) = delete;
+    HugePageArena& operator=(const HugePageArena&) = delete;
+
+    Allocator& allocator() { return *this->arena_allocator; }
+    /** The backing the arena has got. */
+    HugePages pages() const { return this->backing; }
+    /** The node the arena is bound to or -1 if it is not bound. */
+    int node() const { return this->bound_node; }
+    size_t arena_size() const { return this->size; }
+
+private:
+    void *base;
+    size_t size;
+    Allocator* arena_allocator;
+    HugePages backing;
+    int bound_node;
+};
+
+/**
+  * @brief Arena per NUMA node, each thread draws from the arena of its own
+  * node. On a single-node machine, or when the nodes cannot be detected,
+  * there is one unbound arena.
+  *
+  * The node of a thread is looked up once, at its first call of local(), so
+  * threads are expected to be pinned to the CPUs of one node. Memory areas
+  * are freed with the allocator they were allocated from, which may belong
+  * to another node.
+  */
+class NumaArenas {
+public:
+    /** @arg size_per_node - arena size of every node.
+      * @arg pages - the preferred backing of the arenas.
+      * @throw AllocError if an arena cannot be mapped.
+      */
+    explicit NumaArenas(
+        size_t size_per_node, HugePages pages = HugePages::Transparent
+    );
+    ~NumaArenas();
+
+    NumaArenas(const NumaArenas&) = delete;
+    NumaArenas& operator=(const NumaArenas&) = delete;
+
+    /** Returns the concurrent allocator of the calling thread's node. */
+    Allocator& local();
+    /** Returns the allocator of the node with the specified index. */
+    Allocator& node(size_t index) {
+        return this->arenas[index]->allocator();
+    }
+    size_t node_count() const { return this->arenas.size(); }
+
+    /** Returns the NUMA nodes with memory, empty if they are unknown. */
+    static std::vector<int> online_nodes();
+
+private:
+    std::vector<HugePageArena*> arenas;
+    /** Arena index by the node number. */
+    std::vector<size_t> by_node;
+};
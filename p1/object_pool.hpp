@@ -0,0 +1,130 @@
+#pragma once
+
+#include "allocator.hpp"
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+/**
+  * @brief Pool of objects of one type. Objects are carved from slabs pinned
+  * in the Allocator arena, so allocating and freeing an object is a free
+  * list pop and push, and plain pointers to the objects stay valid across
+  * defrag. Slabs are returned to the arena when the pool is destroyed.
+  *
+  * The pool is not thread-safe.
+  */
+template <typename T>
+class ObjectPool {
+public:
+    /** @arg allocator - allocator to carve slabs from.
+      * @arg objects_per_slab - number of objects in one slab.
+      */
+    explicit ObjectPool(Allocator &allocator, size_t objects_per_slab = 64):
+        allocator(allocator),
+        per_slab(objects_per_slab ? objects_per_slab : 1),
+        slabs(nullptr),
+        free_list(nullptr)
+    {}
+
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    /** Returns all the slabs to the arena. Destructors of the objects which
+      * are still alive are not called.
+      */
+    ~ObjectPool() {
+        while (this->slabs) {
+            Slab* next = this->slabs->next;
+            this->allocator.free_pinned(this->slabs);
+            this->slabs = next;
+        }
+    }
+
+    /** Returns storage for one object without constructing it.
+      * @throw AllocError if there is no room for a new slab.
+      */
+    void *allocate() {
+        if (!this->free_list) {
+            this->addSlab();
+        }
+        Node* node = this->free_list;
+        this->free_list = node->next;
+        return node;
+    }
+
+    /** Returns the storage obtained with allocate to the pool. */
+    void deallocate(void *p) {
+        Node* node = static_cast<Node*>(p);
+        node->next = this->free_list;
+        this->free_list = node;
+    }
+
+    /** Allocates and constructs an object. */
+    template <typename... Args>
+    T* create(Args&&... args) {
+        void *p = this->allocate();
+        try {
+            return new (p) T(std::forward<Args>(args)...);
+        } catch (...) {
+            this->deallocate(p);
+            throw;
+        }
+    }
+
+    /** Destroys the object created with create and frees its storage. */
+    void destroy(T* p) {
+        if (p) {
+            p->~T();
+            this->deallocate(p);
+        }
+    }
+
+private:
+    /** Object storage. Links the free list while the object is not alive. */
+    union Node {
+        Node* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    static_assert(
+        alignof(Node) <= 16,
+        "Slabs are aligned to 16 bytes, the object alignment is larger"
+    );
+
+    /** Slab header followed by the objects. */
+    struct Slab {
+        Slab* next;
+    };
+
+    /** Offset of the first object in the slab. */
+    static size_t slabHeader() {
+        return (sizeof(Slab) + alignof(Node) - 1) / alignof(Node) *
+            alignof(Node);
+    }
+
+    /** Carves a new slab and puts all its objects to the free list. */
+    void addSlab() {
+        unsigned char* raw = static_cast<unsigned char*>(
+            this->allocator.alloc_pinned(
+                slabHeader() + this->per_slab * sizeof(Node)
+            )
+        );
+        Slab* slab = reinterpret_cast<Slab*>(raw);
+        slab->next = this->slabs;
+        this->slabs = slab;
+
+        Node* nodes = reinterpret_cast<Node*>(raw + slabHeader());
+        for (size_t i = this->per_slab; i > 0; i--) {
+            nodes[i - 1].next = this->free_list;
+            this->free_list = &nodes[i - 1];
+        }
+    }
+
+    Allocator& allocator;
+    size_t per_slab;
+    /** List of the slabs carved from the arena. */
+    Slab* slabs;
+    /** Free objects of all the slabs. */
+    Node* free_list;
+};
@@ -0,0 +1,279 @@
+#include "region_allocator.hpp"
+
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+  * @brief Region mapped by the allocator. The region allocator is the first
+  * member, so the region of a pointer is found by the address of its
+  * allocator.
+  */
+struct RegionAllocator::Region {
+    Allocator allocator;
+    void *base;
+    size_t size;
+    /** Number of live memory areas. */
+    size_t live;
+    /** Bucket of the region or BUCKETS if it has no free space. */
+    size_t bucket;
+    /** Links of the bucket list. */
+    Region* prev;
+    Region* next;
+    /** Links of the list of all the regions. */
+    Region* prev_all;
+    Region* next_all;
+
+    Region(void *_base, size_t _size):
+        allocator(_base, _size), base(_base), size(_size),
+        live(0), bucket(BUCKETS), prev(nullptr), next(nullptr),
+        prev_all(nullptr), next_all(nullptr)
+    {}
+};
+
+/** Returns the index of the most significant bit of a non-zero value. */
+static inline size_t highestBit(uint64_t value)
+{
+    return 63 - __builtin_clzll((unsigned long long)value);
+}
+
+RegionAllocator::RegionAllocator(size_t region_size, size_t spare_regions):
+    region_size(region_size), spare_regions(spare_regions), all(nullptr),
+    bucket_bitmap(0), spare(0), regions(0), mapped(0)
+{
+    static_assert(
+        std::is_standard_layout<Region>::value,
+        "The region is found by the address of its allocator"
+    );
+    for (size_t i = 0; i < BUCKETS; i++) {
+        this->buckets[i] = nullptr;
+    }
+}
+
+RegionAllocator::~RegionAllocator()
+{
+    while (this->all) {
+        Region* region = this->all;
+        this->all = region->next_all;
+        void *base = region->base;
+        size_t size = region->size;
+        delete region;
+        munmap(base, size);
+    }
+}
+
+RegionAllocator::Region* RegionAllocator::regionOf(const Pointer &p) const
+{
+    // Pointers of other allocators are not dereferenced
+    if (!this->region_allocators.count(p.allocator)) {
+        throw AllocError(
+            AllocErrorType::InvalidFree,
+            "The pointer is invalid or created by the different allocator"
+        );
+    }
+    return reinterpret_cast<Region*>(p.allocator);
+}
+
+RegionAllocator::Region* RegionAllocator::addRegion(size_t block)
+{
+    // Room for the block whatever its size class is
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (2 * block > this->region_size) ?
+        2 * block : this->region_size;
+    size = (size + page - 1) & ~(page - 1);
+
+    void *base = mmap(
+        nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+        -1, 0
+    );
+    if (base == MAP_FAILED) {
+        throw AllocError(AllocErrorType::NoMemory, "Unable to map a region");
+    }
+
+    Region* region = nullptr;
+    try {
+        region = new Region(base, size);
+        this->region_allocators.insert(&region->allocator);
+    } catch (...) {
+        delete region;
+        munmap(base, size);
+        throw;
+    }
+    region->next_all = this->all;
+    if (this->all) {
+        this->all->prev_all = region;
+    }
+    this->all = region;
+    this->regions++;
+    this->spare++;
+    this->mapped += size;
+    this->updateBucket(region);
+    return region;
+}
+
+void RegionAllocator::releaseRegion(Region* region)
+{
+    // Keep some empty regions for the next burst, without their pages
+    if (this->spare < this->spare_regions) {
+        region->allocator.release_free_pages();
+        this->spare++;
+        this->updateBucket(region);
+        return;
+    }
+
+    this->unlinkBucket(region);
+    if (region->prev_all) {
+        region->prev_all->next_all = region->next_all;
+    } else {
+        this->all = region->next_all;
+    }
+    if (region->next_all) {
+        region->next_all->prev_all = region->prev_all;
+    }
+    this->regions--;
+    this->mapped -= region->size;
+    this->region_allocators.erase(&region->allocator);
+
+    void *base = region->base;
+    size_t size = region->size;
+    delete region;
+    munmap(base, size);
+}
+
+void RegionAllocator::unlinkBucket(Region* region)
+{
+    if (region->bucket == BUCKETS) {
+        return;
+    }
+    if (region->prev) {
+        region->prev->next = region->next;
+    } else {
+        this->buckets[region->bucket] = region->next;
+        if (!region->next) {
+            this->bucket_bitmap &= ~((uint64_t)1 << region->bucket);
+        }
+    }
+    if (region->next) {
+        region->next->prev = region->prev;
+    }
+    region->bucket = BUCKETS;
+    region->prev = nullptr;
+    region->next = nullptr;
+}
+
+void RegionAllocator::updateBucket(Region* region)
+{
+    size_t bound = region->allocator.largest_free_bound();
+    size_t bucket = bound ? highestBit(bound) : BUCKETS;
+    if (bucket == region->bucket) {
+        return;
+    }
+
+    this->unlinkBucket(region);
+    if (bucket == BUCKETS) {
+        return;
+    }
+    region->bucket = bucket;
+    region->next = this->buckets[bucket];
+    if (region->next) {
+        region->next->prev = region;
+    }
+    this->buckets[bucket] = region;
+    this->bucket_bitmap |= (uint64_t)1 << bucket;
+}
+
+RegionAllocator::Region* RegionAllocator::findRegion(size_t block) const
+{
+    // Every region of the bucket 2^k >= block fits. The fullest one is
+    // taken so the emptier regions may drain.
+    size_t bucket = (block > 1) ? highestBit(block - 1) + 1 : 0;
+    if (bucket >= BUCKETS) {
+        return nullptr;
+    }
+    uint64_t candidates = this->bucket_bitmap & (~(uint64_t)0 << bucket);
+    if (candidates == 0) {
+        return nullptr;
+    }
+    return this->buckets[__builtin_ctzll(candidates)];
+}
+
+Pointer RegionAllocator::alloc(size_t N)
+{
+    // Invalid zero-size memory allocation.
+    if (N == 0) {
+        return Pointer();
+    }
+
+    size_t block = Allocator::block_size(N);
+    Region* region = this->findRegion(block);
+    if (!region) {
+        region = this->addRegion(block);
+    }
+
+    Pointer p = region->allocator.alloc(N);
+    if (region->live++ == 0) {
+        this->spare--;
+    }
+    this->updateBucket(region);
+    return p;
+}
+
+void RegionAllocator::realloc(Pointer &p, size_t N)
+{
+    if (!p.allocator) {
+        p = this->alloc(N);
+        return;
+    }
+    if (N == 0) {
+        this->free(p);
+        return;
+    }
+
+    Region* region = this->regionOf(p);
+    try {
+        region->allocator.realloc(p, N);
+        this->updateBucket(region);
+        return;
+    } catch (AllocError &e) {
+        if (e.getType() != AllocErrorType::NoMemory) {
+            throw;
+        }
+    }
+
+    // The own region is full, the area moves to another one
+    Pointer moved = this->alloc(N);
+    size_t size = region->allocator.usable_size(p);
+    memcpy(moved.get(), p.get(), (size < N) ? size : N);
+    this->free(p);
+    p = std::move(moved);
+}
+
+void RegionAllocator::free(Pointer &p)
+{
+    Region* region = this->regionOf(p);
+    region->allocator.free(p);
+
+    if (--region->live == 0) {
+        this->releaseRegion(region);
+    } else {
+        this->updateBucket(region);
+    }
+}
+
+void RegionAllocator::defrag()
+{
+    for (Region* region = this->all; region; region = region->next_all) {
+        region->allocator.defrag();
+        this->updateBucket(region);
+    }
+}
+
+void RegionAllocator::trim()
+{
+    for (Region* region = this->all; region; region = region->next_all) {
+        region->allocator.release_free_pages();
+    }
+}
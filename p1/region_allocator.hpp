@@ -0,0 +1,88 @@
+#pragma once
+
+#include "allocator.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_set>
+
+/**
+  * @brief Allocator which grows on demand. Memory areas are allocated from
+  * regions mapped with mmap, a new region is mapped when none of the
+  * existing ones has room. Emptied regions are returned to the OS: spare
+  * ones are unmapped, the rest are released with madvise and stay mapped.
+  *
+  * Regions are indexed by their largest free block, so the cost of alloc,
+  * realloc and free does not depend on the number of regions.
+  *
+  * The allocator is not thread-safe.
+  */
+class RegionAllocator {
+public:
+    /** @arg region_size - size of a regular region. Larger requests get a
+      * region of their own.
+      * @arg spare_regions - empty regions kept mapped, with their pages
+      * released, to serve the next burst.
+      */
+    explicit RegionAllocator(
+        size_t region_size = 64 * 1024 * 1024, size_t spare_regions = 1
+    );
+    /** Unmaps all the regions. */
+    ~RegionAllocator();
+
+    RegionAllocator(const RegionAllocator&) = delete;
+    RegionAllocator& operator=(const RegionAllocator&) = delete;
+
+    Pointer alloc(size_t N);
+    /** Reallocates the memory area. Moves it to another region when its
+      * own region has no room.
+      */
+    void realloc(Pointer &p, size_t N);
+    void free(Pointer &p);
+
+    /** Defragments every region. */
+    void defrag();
+    /** Returns the free pages of every region to the OS. */
+    void trim();
+
+    /** Number of the mapped regions. */
+    size_t region_count() const { return this->regions; }
+    /** Bytes of the mapped regions. */
+    size_t mapped_bytes() const { return this->mapped; }
+
+private:
+    struct Region;
+
+    /** Buckets of regions by the highest bit of the largest free block. */
+    static const size_t BUCKETS = 64;
+
+    /** Returns the region of the pointer. Throws if it is not ours. */
+    Region* regionOf(const Pointer &p) const;
+    /** Maps a new region with room for a block of the specified size. */
+    Region* addRegion(size_t block);
+    /** Unmaps or releases the pages of the emptied region. */
+    void releaseRegion(Region* region);
+    /** Moves the region to the bucket of its largest free block. */
+    void updateBucket(Region* region);
+    void unlinkBucket(Region* region);
+    /** Returns a region sure to fit the block or nullptr. */
+    Region* findRegion(size_t block) const;
+
+    size_t region_size;
+    size_t spare_regions;
+    /** All the regions, for the destructor and defrag. */
+    Region* all;
+    /** Allocators of the regions. A pointer is checked against them before
+      * its region is touched.
+      */
+    std::unordered_set<const Allocator*> region_allocators;
+    /** Region lists per bucket. Bit i of the bitmap is set when bucket i is
+      * not empty.
+      */
+    Region* buckets[BUCKETS];
+    uint64_t bucket_bitmap;
+    /** Empty regions with released pages. */
+    size_t spare;
+    size_t regions;
+    size_t mapped;
+};
@@ -0,0 +1,80 @@
+#include "shared_arena.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Returns the error with the description of errno appended. */
+static AllocError sharingError(const std::string &message)
+{
+    return AllocError(
+        AllocErrorType::InvalidArena, message + ": " + strerror(errno)
+    );
+}
+
+SharedArena::SharedArena(const std::string &name, size_t size):
+    base(MAP_FAILED), size(size), arena_allocator(nullptr),
+    was_created(false)
+{
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd == -1) {
+        throw sharingError("Unable to open the shared arena " + name);
+    }
+
+    try {
+        // The creator holds the lock until the arena is initialized
+        if (flock(fd, LOCK_EX) == -1) {
+            throw sharingError("Unable to lock the shared arena " + name);
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            throw sharingError("Unable to stat the shared arena " + name);
+        }
+        if (st.st_size > 0) {
+            this->size = st.st_size;
+        } else if (ftruncate(fd, this->size) == -1) {
+            throw sharingError("Unable to resize the shared arena " + name);
+        } else {
+            this->was_created = true;
+        }
+
+        this->base = mmap(
+            nullptr, this->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+        );
+        if (this->base == MAP_FAILED) {
+            throw sharingError("Unable to map the shared arena " + name);
+        }
+
+        this->arena_allocator = new Allocator(
+            this->base, this->size, AllocatorMode::Shared
+        );
+    } catch (...) {
+        if (this->base != MAP_FAILED) {
+            munmap(this->base, this->size);
+        }
+        close(fd);
+        throw;
+    }
+
+    // The mapping keeps the open file and its lock, so the lock is
+    // released explicitly
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+SharedArena::~SharedArena()
+{
+    delete this->arena_allocator;
+    munmap(this->base, this->size);
+}
+
+void SharedArena::remove(const std::string &name)
+{
+    shm_unlink(name.c_str());
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "allocator.hpp"
+
+#include <cstddef>
+#include <string>
+
+/**
+  * @brief Allocator arena in a POSIX shared memory object, used by several
+  * processes at once. The first process creates the arena, the rest attach
+  * to it. Memory areas are passed between processes as handles, see
+  * Allocator::to_handle and Allocator::root.
+  *
+  * The arena is mapped at different addresses in different processes: plain
+  * pointers must not be stored in the arena or passed around, and a defrag
+  * in one process invalidates plain pointers in all of them.
+  */
+class SharedArena {
+public:
+    /** Opens the shared memory object, creating the arena of the specified
+      * size if the object does not exist yet.
+      * @arg name - shared memory object name, e.g. "/kv_values".
+      * @throw AllocError if the object cannot be mapped.
+      */
+    SharedArena(const std::string &name, size_t size);
+    /** Unmaps the arena. The shared memory object stays. */
+    ~SharedArena();
+
+    SharedArena(const SharedArena&) = delete;
+    SharedArena& operator=(const SharedArena&) = delete;
+
+    Allocator& allocator() { return *this->arena_allocator; }
+    /** Whether the arena has been created by this process. */
+    bool created() const { return this->was_created; }
+
+    /** Removes the shared memory object. Processes which have it mapped
+      * keep using it.
+      */
+    static void remove(const std::string &name);
+
+private:
+    void *base;
+    size_t size;
+    Allocator* arena_allocator;
+    bool was_created;
+};
@@ -10,10 +10,26 @@
 
 std::random_device rd;
 
-PortListener::PortListener(boost::asio::io_service& io_service, unsigned short port, const std::list<Destination>* destinations):
+/** Picks destinations, one generator per event loop thread */
+static thread_local std::minstd_rand destination_rand(rd());
+
+PortListener::PortListener(
+	boost::asio::io_service& io_service, unsigned short port, const std::list<Destination>* destinations,
+	const SessionOptions& session_options
+):
 	_acceptor(io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
-	_destinations(*destinations)
+	_destinations(*destinations),
+	_session_count(0),
+	_session_options(session_options),
+	_is_listening(true)
 {
+	if ((this->_session_options.ring_depth == 0) || (this->_session_options.ring_depth > MAX_RING_DEPTH)) {
+		this->_session_options.ring_depth = (this->_session_options.ring_depth == 0) ? 1 : MAX_RING_DEPTH;
+	}
+	if (this->_session_options.max_buffer_size < BUFFER_SIZE) {
+		this->_session_options.max_buffer_size = BUFFER_SIZE;
+	}
+
 	this->accept();
 }
 
@@ -28,9 +44,14 @@ void PortListener::handle_accept(const boost::system::error_code& err, boost::sh
 		std::uniform_int_distribution<int> rand_dist(0, this->_destinations.size() - 1);
 		auto dest_iterator = this->_destinations.cbegin();
 
-		std::advance(dest_iterator, rand_dist(rd));
+		std::advance(dest_iterator, rand_dist(destination_rand));
 
-		this->_sessions.push_back(session);
+		{
+			std::lock_guard<std::mutex> guard(this->_lock);
+			session->_slot = this->_sessions.size();
+			this->_sessions.push_back(session);
+			this->_session_count.store(this->_sessions.size(), std::memory_order_relaxed);
+		}
 		session->client_start(dest_iterator->host, dest_iterator->port);
 		this->accept();
     } else if (err != boost::asio::error::operation_aborted) {
@@ -42,6 +63,11 @@ void PortListener::handle_accept(const boost::system::error_code& err, boost::sh
 void PortListener::accept()
 {
 	boost::shared_ptr<Session> new_session = boost::make_shared<Session>(*this);
+
+	std::lock_guard<std::mutex> guard(this->_lock);
+	if (!this->_is_listening) {
+		return;
+	}
 	this->_acceptor.async_accept(*new_session->client_socket(), boost::bind(&PortListener::handle_accept, this, _1, new_session));
 }
 
@@ -50,25 +76,49 @@ boost::asio::io_service* PortListener::get_sevice()
 	return &(this->_acceptor.get_io_service());
 }
 
+const SessionOptions& PortListener::session_options() const
+{
+	return this->_session_options;
+}
+
+size_t PortListener::session_count() const
+{
+	return this->_session_count.load(std::memory_order_relaxed);
+}
+
 void PortListener::stop_listening()
 {
+	std::lock_guard<std::mutex> guard(this->_lock);
+	this->_is_listening = false;
 	this->_acceptor.cancel();
 }
 
 void PortListener::terminate_sessions()
 {
-	for ( auto session : this->_sessions ) {
+	std::vector<boost::shared_ptr<Session>> sessions;
+	{
+		std::lock_guard<std::mutex> guard(this->_lock);
+		sessions.swap(this->_sessions);
+		this->_session_count.store(0, std::memory_order_relaxed);
+	}
+
+	for ( auto session : sessions ) {
 		session->terminate();
 	}
-	this->_sessions.clear();
 }
 
 void PortListener::handle_session_close(boost::shared_ptr<Session> session)
 {
-	for (auto isession = this->_sessions.begin(); isession != this->_sessions.end(); ++isession) {
-		if (*isession == session) {
-			this->_sessions.erase(isession);
-			break;
-		}
+	std::lock_guard<std::mutex> guard(this->_lock);
+	// The session is not in the list if it has been taken by terminate_sessions
+	size_t slot = session->_slot;
+	if ((slot >= this->_sessions.size()) || (this->_sessions[slot] != session)) {
+		return;
 	}
+
+	// The caller holds a reference, the session is not released under the lock
+	this->_sessions[slot].swap(this->_sessions.back());
+	this->_sessions[slot]->_slot = slot;
+	this->_sessions.pop_back();
+	this->_session_count.store(this->_sessions.size(), std::memory_order_relaxed);
 }
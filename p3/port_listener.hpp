@@ -4,9 +4,13 @@
 	#define _WIN32_WINNT 0x0501
 #endif
 
+#include <atomic>
 #include <list>
+#include <mutex>
+#include <vector>
 
 #include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
 
 #include "session.hpp"
@@ -19,10 +23,16 @@ struct Destination {
 class PortListener: public boost::noncopyable
 {
 public:
-	PortListener(boost::asio::io_service& io_service, unsigned short port, const std::list<Destination>* destinations);
+	PortListener(
+		boost::asio::io_service& io_service, unsigned short port, const std::list<Destination>* destinations,
+		const SessionOptions& session_options = SessionOptions()
+	);
 	~PortListener();
 
 	boost::asio::io_service* get_sevice();
+	const SessionOptions& session_options() const;
+	/** Number of the sessions accepted and not closed yet, read without the lock */
+	size_t session_count() const;
 
 	void stop_listening();
 	void terminate_sessions();
@@ -34,5 +44,14 @@ private:
 
 	boost::asio::ip::tcp::acceptor _acceptor;
 	std::list<Destination> _destinations;
-	std::list<boost::shared_ptr<Session>> _sessions;
+	/** Live sessions, each one knows its index. A closed session is replaced by the last one */
+	std::vector<boost::shared_ptr<Session>> _sessions;
+	std::atomic<size_t> _session_count;
+	SessionOptions _session_options;
+
+	/** Guards the acceptor and the sessions list: handlers of the listener
+	  * and of its sessions run on any thread of the io_service pool
+	  */
+	std::mutex _lock;
+	bool _is_listening;
 };
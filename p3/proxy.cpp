@@ -1,8 +1,11 @@
+#include <cstdlib>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <list>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "port_listener.hpp"
 
@@ -59,13 +62,47 @@ void parse_config_file(const char* filename, std::list<ConfigEntry>& config_entr
 
 std::list<PortListener*> listeners;
 
+/** Runs the event loop on the specified number of threads, the calling
+  *  thread included. Returns when the io_service runs out of work.
+  *  @param io_service - event loop shared by all the listeners;
+  *  @param thread_count - number of threads to run the event loop on
+  */
+void run_service_pool(boost::asio::io_service& io_service, size_t thread_count)
+{
+	std::vector<std::thread> threads;
+
+	for (size_t i = 1; i < thread_count; i++) {
+		threads.push_back(std::thread([&io_service]() { io_service.run(); }));
+	}
+
+	io_service.run();
+
+	for ( auto& thread : threads ) {
+		thread.join();
+	}
+}
+
 int main(int argc, char* argv[])
 {
 	if (argc < 2) {
 		std::cerr << "ERROR: Need a config file name as a parameter" << std::endl;
+		std::cerr << "Usage: proxy <config file> [event loop threads] [buffered|splice]" << std::endl;
 		return 1;
 	}
 
+	size_t thread_count = std::thread::hardware_concurrency();
+	if (argc > 2) {
+		thread_count = std::strtoul(argv[2], nullptr, 10);
+	}
+	if (thread_count == 0) {
+		thread_count = 1;
+	}
+
+	SessionOptions session_options;
+	if ((argc > 3) && (std::string(argv[3]) == "splice")) {
+		session_options.forwarding_mode = ForwardingMode::Splice;
+	}
+
 	std::list<ConfigEntry> config_entries;
 
 	parse_config_file(argv[1], config_entries);
@@ -73,10 +110,10 @@ int main(int argc, char* argv[])
 	boost::asio::io_service io_service;
 
 	for ( auto config_entry : config_entries ) {
-		listeners.push_back(new PortListener(io_service, config_entry.source_port, &(config_entry.destinations)));
+		listeners.push_back(new PortListener(io_service, config_entry.source_port, &(config_entry.destinations), session_options));
 	}
 
-	io_service.run();
+	run_service_pool(io_service, thread_count);
 
     for ( auto listener : listeners ) {
         listener->stop_listening();
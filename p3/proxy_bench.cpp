@@ -0,0 +1,240 @@
+/** Throughput benchmark of the proxy against the number of event loop threads, the forwarding mode
+  *  and the latency of the server. Clients push data through a PortListener to a sink server, all on
+  *  the loopback. The sink delays the data it reads to emulate a distant server without netem.
+  *  CPU time is counted for the event loop threads only.
+  *  Build: g++ -std=c++11 -O2 -o proxy_bench proxy_bench.cpp port_listener.cpp session.cpp -lboost_system -lpthread
+  *  Usage: proxy_bench [connections] [seconds] [port]
+  */
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <time.h>
+
+#include "port_listener.hpp"
+
+using boost::asio::ip::tcp;
+
+/** Bytes read by the sink from all the connections */
+std::atomic<unsigned long long> received(0);
+
+/** Bytes per second a sink connection may receive, above what the loopback carries. The window of a
+  *  delayed connection holds this rate times the delay, so the window never caps the throughput.
+  */
+#define SINK_BANDWIDTH (10ULL * 1024 * 1024 * 1024)
+/** The smallest window of a sink connection, in bytes */
+#define SINK_WINDOW (1024 * 1024)
+
+/** Accepts the specified number of connections and reads them until they are closed.
+  *  The data read is counted after the delay, like a delay line with a window above bandwidth x delay.
+  *  @param io_service - event loop of the sink sockets;
+  *  @param acceptor - listening sink socket;
+  *  @param connections - number of connections to serve;
+  *  @param delay - one-way delay of the sink connections
+  */
+void run_sink(
+	boost::asio::io_service* io_service, tcp::acceptor* acceptor, size_t connections,
+	std::chrono::microseconds delay
+)
+{
+	std::vector<std::thread> readers;
+
+	for (size_t i = 0; i < connections; i++) {
+		auto socket = std::make_shared<tcp::socket>(*io_service);
+		acceptor->accept(*socket);
+
+		readers.push_back(std::thread([socket, delay]() {
+			typedef std::chrono::steady_clock clock;
+			std::deque<std::pair<clock::time_point, size_t>> line;
+			size_t in_flight = 0;
+			size_t window = SINK_WINDOW + SINK_BANDWIDTH * delay.count() / 1000000;
+
+			std::vector<unsigned char> buffer(65536);
+			boost::system::error_code err;
+			while (true) {
+				auto now = clock::now();
+				while (!line.empty() && (line.front().first <= now)) {
+					received += line.front().second;
+					in_flight -= line.front().second;
+					line.pop_front();
+				}
+				if (in_flight >= window) {
+					std::this_thread::sleep_until(line.front().first);
+					continue;
+				}
+
+				size_t size = socket->read_some(boost::asio::buffer(buffer), err);
+				if (err) {
+					break;
+				}
+				if (delay.count() == 0) {
+					received += size;
+				} else {
+					line.push_back(std::make_pair(clock::now() + delay, size));
+					in_flight += size;
+				}
+			}
+		}));
+	}
+
+	for ( auto& reader : readers ) {
+		reader.join();
+	}
+}
+
+/** Sends data to the proxy until stopped.
+  *  @param port - proxy port;
+  *  @param stop - set when the measurement is over
+  */
+void run_client(unsigned short port, const std::atomic<bool>* stop)
+{
+	boost::asio::io_service io_service;
+	tcp::socket socket(io_service);
+	socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+
+	std::vector<unsigned char> buffer(65536, 'x');
+	boost::system::error_code err;
+	while (!*stop) {
+		boost::asio::write(socket, boost::asio::buffer(buffer), err);
+		if (err) {
+			break;
+		}
+	}
+
+	socket.shutdown(tcp::socket::shutdown_both, err);
+	socket.close(err);
+}
+
+/** Results of one measurement */
+struct Measurement {
+	/** Gigabits per second passed through the proxy */
+	double gbps;
+	/** CPU time of the event loop threads per kilobyte passed */
+	double cpu_ns_per_kb;
+};
+
+/** Returns the total CPU time of the threads in nanoseconds */
+double cpu_time_ns(std::vector<std::thread>& threads)
+{
+	double total = 0;
+	for ( auto& thread : threads ) {
+		clockid_t clock;
+		timespec time;
+		if ((pthread_getcpuclockid(thread.native_handle(), &clock) == 0) && (clock_gettime(clock, &time) == 0)) {
+			total += time.tv_sec * 1e9 + time.tv_nsec;
+		}
+	}
+	return total;
+}
+
+/** Measures the throughput with the specified number of event loop threads and session options */
+Measurement measure(
+	size_t thread_count, const SessionOptions& session_options, std::chrono::microseconds delay,
+	size_t connections, double seconds, unsigned short port
+)
+{
+	boost::asio::io_service sink_service;
+	tcp::acceptor sink(sink_service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+	std::thread sink_thread(run_sink, &sink_service, &sink, connections, delay);
+
+	std::list<Destination> destinations;
+	destinations.push_back(Destination{"127.0.0.1", sink.local_endpoint().port()});
+
+	boost::asio::io_service io_service;
+	PortListener* listener = new PortListener(io_service, port, &destinations, session_options);
+
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < thread_count; i++) {
+		threads.push_back(std::thread([&io_service]() { io_service.run(); }));
+	}
+
+	std::atomic<bool> stop(false);
+	std::vector<std::thread> clients;
+	for (size_t i = 0; i < connections; i++) {
+		clients.push_back(std::thread(run_client, port, &stop));
+	}
+
+	// Skip the connection setup
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	unsigned long long before = received;
+	double cpu_before = cpu_time_ns(threads);
+	auto start = std::chrono::steady_clock::now();
+	std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+	unsigned long long after = received;
+	double cpu_after = cpu_time_ns(threads);
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	// Closed clients end their sessions, the sessions close the sink connections
+	stop = true;
+	for ( auto& client : clients ) {
+		client.join();
+	}
+	sink_thread.join();
+
+	listener->stop_listening();
+	listener->terminate_sessions();
+	for ( auto& thread : threads ) {
+		thread.join();
+	}
+	delete listener;
+
+	Measurement result;
+	result.gbps = (after - before) * 8 / elapsed / 1e9;
+	result.cpu_ns_per_kb = (after > before) ? (cpu_after - cpu_before) / ((after - before) / 1024.0) : 0;
+	return result;
+}
+
+int main(int argc, char* argv[])
+{
+	size_t connections = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 16;
+	double seconds = (argc > 2) ? std::strtod(argv[2], nullptr) : 2;
+	unsigned short port = (argc > 3) ? std::strtoul(argv[3], nullptr, 10) : 23456;
+
+	size_t max_threads = std::thread::hardware_concurrency();
+	if (max_threads < 4) {
+		max_threads = 4;
+	}
+
+	const ForwardingMode modes[] = {ForwardingMode::Buffered, ForwardingMode::Splice};
+	const char* mode_names[] = {"buffered", "splice"};
+
+	std::cout << "threads / mode / Gbps / event loop CPU ns per KB (" << connections << " connections)" << std::endl;
+	for (size_t thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+		for (size_t i = 0; i < 2; i++) {
+			SessionOptions session_options;
+			session_options.forwarding_mode = modes[i];
+			Measurement result = measure(
+				thread_count, session_options, std::chrono::microseconds(0), connections, seconds, port
+			);
+			std::cout << "  " << thread_count << "\t" << mode_names[i] << "\t" << result.gbps << "\t" <<
+				result.cpu_ns_per_kb << std::endl;
+		}
+	}
+
+	// One 4KB buffer per direction, as before the buffer rings, against the default ring
+	SessionOptions single;
+	single.ring_depth = 1;
+	single.max_buffer_size = BUFFER_SIZE;
+	const SessionOptions buffering[] = {single, SessionOptions()};
+	const char* buffering_names[] = {"single 4KB", "ring"};
+	const int delays_ms[] = {0, 1, 5, 20};
+
+	std::cout << "server delay ms / buffering / Gbps (" << max_threads << " threads)" << std::endl;
+	for (int delay_ms : delays_ms) {
+		for (size_t i = 0; i < 2; i++) {
+			Measurement result = measure(
+				max_threads, buffering[i], std::chrono::milliseconds(delay_ms), connections, seconds, port
+			);
+			std::cout << "  " << delay_ms << "\t" << buffering_names[i] << "\t" << result.gbps << std::endl;
+		}
+	}
+
+	return 0;
+}
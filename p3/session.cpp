@@ -1,14 +1,23 @@
 #include "session.hpp"
 
+#include <algorithm>
+#include <cerrno>
 #include <iostream>
 #include <stdexcept>
 
 #include <boost/bind.hpp>
 
+#ifdef __linux__
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
 #include "port_listener.hpp"
 
 Session::Session(PortListener& listener):
-    _listener(&listener), _server_socket(*listener.get_sevice()), _client_socket(*listener.get_sevice()),
+    _listener(&listener), _slot(0), _options(listener.session_options()), _strand(*listener.get_sevice()),
+    _server_socket(*listener.get_sevice()), _client_socket(*listener.get_sevice()),
+    _client_to_server_pipe{-1, -1, 0}, _server_to_client_pipe{-1, -1, 0},
     _is_to_be_terminated(false), _client_is_connected(false), _server_is_connected(false)
 {
 	
@@ -16,7 +25,15 @@ Session::Session(PortListener& listener):
 
 Session::~Session()
 {
-
+#ifdef __linux__
+    SplicePipe* pipes[] = {&this->_client_to_server_pipe, &this->_server_to_client_pipe};
+    for ( auto pipe : pipes ) {
+        if (pipe->read_fd != -1) {
+            close(pipe->read_fd);
+            close(pipe->write_fd);
+        }
+    }
+#endif
 }
 
 void Session::termination_routine(boost::shared_ptr<Session> session)
@@ -43,8 +60,13 @@ void Session::handle_server_connect(const boost::system::error_code& err, boost:
 {
 	if (!err) {
         session->_server_is_connected = true;
-        session->receive_from_client();
-        session->receive_from_server();
+        if ((session->_options.forwarding_mode == ForwardingMode::Splice) && session->open_pipes()) {
+            session->splice_receive(&session->_client_socket, &session->_server_socket, &session->_client_to_server_pipe);
+            session->splice_receive(&session->_server_socket, &session->_client_socket, &session->_server_to_client_pipe);
+        } else {
+            session->receive(&session->_client_socket, &session->_server_socket, &session->_client_to_server_ring);
+            session->receive(&session->_server_socket, &session->_client_socket, &session->_server_to_client_ring);
+        }
     } else if (err == boost::asio::error::connection_refused) {
         Session::termination_routine(session);
     } else if (err != boost::asio::error::operation_aborted) {
@@ -53,90 +75,253 @@ void Session::handle_server_connect(const boost::system::error_code& err, boost:
 	}
 }
 
-void Session::handle_receive_from_client(const boost::system::error_code& err, boost::shared_ptr<Session> session, size_t size)
+void Session::handle_receive(
+    const boost::system::error_code& err, boost::shared_ptr<Session> session,
+    boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, BufferRing* ring, size_t size
+)
 {
+    // The other direction may have closed the sockets after the receive has completed
+    if (session->_is_to_be_terminated) {
+        return;
+    }
+    ring->is_receiving = false;
+
     if (!err) {
-		if (size > 0) {
-            session->send_to_server(size);
-        } else {
-            session->receive_from_client();
-		}
-    } else if (
-        (err == boost::asio::error::eof) || (err == boost::asio::error::connection_reset)
-    ) {
+        if (size > 0) {
+            size_t slot = (ring->head + ring->count) % session->_options.ring_depth;
+            ring->sizes[slot] = size;
+            ring->count++;
+            session->adapt_buffer_size(ring, ring->buffers[slot].size(), size);
+            session->send(from, to, ring);
+        }
+        session->receive(from, to, ring);
+    } else if (err == boost::asio::error::eof) {
+        // The chunks received before are still delivered
+        ring->is_finished = true;
+        if (ring->count == 0) {
+            session->termination_routine(session);
+        }
+    } else if (Session::is_disconnect(err)) {
         session->termination_routine(session);
     } else if (err != boost::asio::error::operation_aborted) {
-        std::cerr << "Session::handle_receive_from_client (" << err.value() << "): " << err.message() << std::endl;
+        std::cerr << "Session::handle_receive (" << err.value() << "): " << err.message() << std::endl;
         throw std::runtime_error(std::string("Error: ") + err.message());
     }
 }
 
-void Session::handle_send_to_client(const boost::system::error_code& err, boost::shared_ptr<Session> session)
+void Session::handle_send(
+    const boost::system::error_code& err, boost::shared_ptr<Session> session,
+    boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, BufferRing* ring
+)
 {
-	if (!err) {
-        session->receive_from_server();
-    } else if (
-       (err == boost::asio::error::eof) || (err == boost::asio::error::connection_reset)
-    ) {
-       session->termination_routine(session);
+    if (session->_is_to_be_terminated) {
+        return;
+    }
+    ring->is_sending = false;
+
+    if (!err) {
+        ring->head = (ring->head + 1) % session->_options.ring_depth;
+        ring->count--;
+        if (ring->is_finished && (ring->count == 0)) {
+            session->termination_routine(session);
+            return;
+        }
+        session->send(from, to, ring);
+        session->receive(from, to, ring);
+    } else if (Session::is_disconnect(err)) {
+        session->termination_routine(session);
     } else if (err != boost::asio::error::operation_aborted) {
-        std::cerr << "Session::handle_send_to_client (" << err.value() << "): " << err.message() << std::endl;
+        std::cerr << "Session::handle_send (" << err.value() << "): " << err.message() << std::endl;
         throw std::runtime_error(std::string("Error: ") + err.message());
     }
 }
 
-void Session::handle_receive_from_server(const boost::system::error_code& err, boost::shared_ptr<Session> session, size_t size)
+void Session::receive(boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, BufferRing* ring)
+{
+    // Backpressure: a full ring waits for the destination to take a chunk
+    if (ring->is_receiving || ring->is_finished || (ring->count == this->_options.ring_depth)) {
+        return;
+    }
+
+    std::vector<unsigned char>& buffer = ring->buffers[(ring->head + ring->count) % this->_options.ring_depth];
+    if (buffer.size() != ring->buffer_size) {
+        buffer.resize(ring->buffer_size);
+    }
+
+    ring->is_receiving = true;
+    from->async_receive(
+        boost::asio::buffer(buffer.data(), buffer.size()),
+        this->_strand.wrap(boost::bind(&Session::handle_receive, _1, this->shared_from_this(), from, to, ring, _2))
+    );
+}
+
+void Session::send(boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, BufferRing* ring)
+{
+    if (ring->is_sending || (ring->count == 0)) {
+        return;
+    }
+
+    ring->is_sending = true;
+    boost::asio::async_write(
+        *to, boost::asio::buffer(ring->buffers[ring->head].data(), ring->sizes[ring->head]),
+        this->_strand.wrap(boost::bind(&Session::handle_send, _1, this->shared_from_this(), from, to, ring))
+    );
+}
+
+void Session::adapt_buffer_size(BufferRing* ring, size_t buffer_size, size_t size)
 {
+    // Bulk transfers fill the buffers, interactive ones leave them mostly empty
+    if ((size == buffer_size) && (ring->buffer_size < this->_options.max_buffer_size)) {
+        ring->buffer_size = std::min(ring->buffer_size * 2, this->_options.max_buffer_size);
+    } else if ((size < buffer_size / 4) && (ring->buffer_size > BUFFER_SIZE)) {
+        ring->buffer_size /= 2;
+    }
+}
+
+bool Session::is_disconnect(const boost::system::error_code& err)
+{
+    return (err == boost::asio::error::eof) || (err == boost::asio::error::connection_reset) ||
+        (err == boost::asio::error::broken_pipe);
+}
+
+void Session::handle_splice_readable(
+    const boost::system::error_code& err, boost::shared_ptr<Session> session,
+    boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, SplicePipe* pipe
+)
+{
+    // The other direction may have closed the sockets after the wait has completed
+    if (session->_is_to_be_terminated) {
+        return;
+    }
+
     if (!err) {
-		if (size > 0) {
-            session->send_to_client(size);
-		} else {
-            session->receive_from_server();
-		}
-    } else if (
-        (err == boost::asio::error::eof) || (err == boost::asio::error::connection_reset)
-    ) {
+        session->splice_transfer(from, to, pipe);
+    } else if (Session::is_disconnect(err)) {
         session->termination_routine(session);
     } else if (err != boost::asio::error::operation_aborted) {
-        std::cerr << "Session::handle_receive_from_server (" << err.value() << "): " << err.message() << std::endl;
+        std::cerr << "Session::handle_splice_readable (" << err.value() << "): " << err.message() << std::endl;
         throw std::runtime_error(std::string("Error: ") + err.message());
     }
 }
 
-void Session::handle_send_to_server(const boost::system::error_code& err, boost::shared_ptr<Session> session)
+void Session::handle_splice_writable(
+    const boost::system::error_code& err, boost::shared_ptr<Session> session,
+    boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, SplicePipe* pipe
+)
 {
-	if (!err) {
-        session->receive_from_client();
-    } else if (
-        (err == boost::asio::error::eof) || (err == boost::asio::error::connection_reset)
-    ) {
+    // The other direction may have closed the sockets after the wait has completed
+    if (session->_is_to_be_terminated) {
+        return;
+    }
+
+    if (!err) {
+        session->splice_flush(from, to, pipe);
+    } else if (Session::is_disconnect(err)) {
         session->termination_routine(session);
     } else if (err != boost::asio::error::operation_aborted) {
-        std::cerr << "Session::handle_send_to_server (" << err.value() << "): " << err.message() << std::endl;
+        std::cerr << "Session::handle_splice_writable (" << err.value() << "): " << err.message() << std::endl;
         throw std::runtime_error(std::string("Error: ") + err.message());
     }
 }
 
-void Session::receive_from_client()
+#ifdef __linux__
+
+/** Bytes moved by one splice() call from a socket to the pipe, the default pipe capacity */
+#define SPLICE_SIZE 65536
+
+bool Session::open_pipes()
+{
+    SplicePipe* pipes[] = {&this->_client_to_server_pipe, &this->_server_to_client_pipe};
+    for ( auto pipe : pipes ) {
+        int fds[2];
+        if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+            return false;
+        }
+        pipe->read_fd = fds[0];
+        pipe->write_fd = fds[1];
+        pipe->pending = 0;
+    }
+
+    // splice() must not block the event loop thread
+    boost::system::error_code err;
+    this->_client_socket.native_non_blocking(true, err);
+    if (!err) {
+        this->_server_socket.native_non_blocking(true, err);
+    }
+    return !err;
+}
+
+void Session::splice_receive(boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, SplicePipe* pipe)
+{
+    from->async_read_some(
+        boost::asio::null_buffers(),
+        this->_strand.wrap(boost::bind(&Session::handle_splice_readable, _1, this->shared_from_this(), from, to, pipe))
+    );
+}
+
+void Session::splice_transfer(boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, SplicePipe* pipe)
+{
+    ssize_t size = splice(
+        from->native_handle(), nullptr, pipe->write_fd, nullptr, SPLICE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+    );
+    if (size > 0) {
+        pipe->pending += size;
+        this->splice_flush(from, to, pipe);
+    } else if (size == 0) {
+        Session::handle_splice_readable(boost::asio::error::eof, this->shared_from_this(), from, to, pipe);
+    } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        this->splice_receive(from, to, pipe);
+    } else {
+        boost::system::error_code err(errno, boost::system::system_category());
+        Session::handle_splice_readable(err, this->shared_from_this(), from, to, pipe);
+    }
+}
+
+void Session::splice_flush(boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, SplicePipe* pipe)
+{
+    while (pipe->pending > 0) {
+        ssize_t size = splice(
+            pipe->read_fd, nullptr, to->native_handle(), nullptr, pipe->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+        );
+        if (size >= 0) {
+            pipe->pending -= size;
+        } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            to->async_write_some(
+                boost::asio::null_buffers(),
+                this->_strand.wrap(boost::bind(&Session::handle_splice_writable, _1, this->shared_from_this(), from, to, pipe))
+            );
+            return;
+        } else {
+            boost::system::error_code err(errno, boost::system::system_category());
+            Session::handle_splice_writable(err, this->shared_from_this(), from, to, pipe);
+            return;
+        }
+    }
+
+    this->splice_receive(from, to, pipe);
+}
+
+#else
+
+bool Session::open_pipes()
 {
-    this->_client_socket.async_receive(boost::asio::buffer(this->_client_read_buffer, BUFFER_SIZE), boost::bind(&Session::handle_receive_from_client, _1, this->shared_from_this(), _2));
+    return false;
 }
 
-void Session::send_to_client(size_t size)
+void Session::splice_receive(boost::asio::ip::tcp::socket*, boost::asio::ip::tcp::socket*, SplicePipe*)
 {
-    this->_client_socket.async_send(boost::asio::buffer(this->_server_read_buffer, size), boost::bind(&Session::handle_send_to_client, _1, this->shared_from_this()));
 }
 
-void Session::receive_from_server()
+void Session::splice_transfer(boost::asio::ip::tcp::socket*, boost::asio::ip::tcp::socket*, SplicePipe*)
 {
-    this->_server_socket.async_receive(boost::asio::buffer(this->_server_read_buffer, BUFFER_SIZE), boost::bind(&Session::handle_receive_from_server, _1, this->shared_from_this(), _2));
 }
 
-void Session::send_to_server(size_t size)
+void Session::splice_flush(boost::asio::ip::tcp::socket*, boost::asio::ip::tcp::socket*, SplicePipe*)
 {
-    this->_server_socket.async_send(boost::asio::buffer(this->_client_read_buffer, size), boost::bind(&Session::handle_send_to_server, _1, this->shared_from_this()));
 }
 
+#endif
+
 boost::asio::ip::tcp::socket* Session::server_socket()
 {
 	return &(this->_server_socket);
@@ -152,12 +337,17 @@ void Session::client_start(const std::string& host, unsigned short port)
 	this->_client_is_connected = true;
     this->_server_socket.async_connect(
 		boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::from_string(host), port),
-        boost::bind(&Session::handle_server_connect, _1, this->shared_from_this())
+        this->_strand.wrap(boost::bind(&Session::handle_server_connect, _1, this->shared_from_this()))
 	);
 }
 
 void Session::terminate()
 {
-	this->_is_to_be_terminated = true;
-    this->termination_routine(this->shared_from_this());
+    this->_strand.dispatch(boost::bind(&Session::terminate_routine, this->shared_from_this()));
+}
+
+void Session::terminate_routine(boost::shared_ptr<Session> session)
+{
+	session->_is_to_be_terminated = true;
+    session->termination_routine(session);
 }
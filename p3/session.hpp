@@ -1,12 +1,19 @@
 #pragma once
 
+/** Initial size of the read buffers */
 #define BUFFER_SIZE 4096
+/** Default limit of the read buffer growth */
+#define MAX_BUFFER_SIZE (256 * 1024)
+/** Default and maximal number of buffers per direction */
+#define RING_DEPTH 4
+#define MAX_RING_DEPTH 16
 
 #ifndef _WIN32_WINNT
 	#define _WIN32_WINNT 0x0501
 #endif
 
 #include <string>
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
@@ -14,6 +21,59 @@
 
 class PortListener;
 
+/** How sessions move the data between the client and the server sockets */
+enum class ForwardingMode {
+	/** Through the read buffers of the session */
+	Buffered,
+	/** With splice() through a pipe per direction, the data never enters the user space.
+	  * Linux only: sessions fall back to Buffered when the pipes cannot be created */
+	Splice,
+};
+
+/** Settings of the sessions of a listener */
+struct SessionOptions {
+	SessionOptions():
+		forwarding_mode(ForwardingMode::Buffered), ring_depth(RING_DEPTH), max_buffer_size(MAX_BUFFER_SIZE)
+	{}
+
+	ForwardingMode forwarding_mode;
+	/** Buffers per direction, up to MAX_RING_DEPTH. Reading stops when all of them wait to be sent */
+	size_t ring_depth;
+	/** Read buffers grow from BUFFER_SIZE up to this size while the reads fill them */
+	size_t max_buffer_size;
+};
+
+/** Buffers of one direction. Received chunks wait in the ring until they are sent,
+  *  so the next receive does not wait for the previous send to complete
+  */
+struct BufferRing {
+	BufferRing():
+		head(0), count(0), buffer_size(BUFFER_SIZE), is_receiving(false), is_sending(false), is_finished(false)
+	{}
+
+	std::vector<unsigned char> buffers[MAX_RING_DEPTH];
+	/** Bytes received into each buffer */
+	size_t sizes[MAX_RING_DEPTH];
+	/** The oldest chunk, it is being sent */
+	size_t head;
+	/** Chunks waiting to be sent */
+	size_t count;
+	/** Size of the buffer for the next receive */
+	size_t buffer_size;
+	bool is_receiving;
+	bool is_sending;
+	/** The source has closed the connection, the ring is drained before the session is terminated */
+	bool is_finished;
+};
+
+/** Pipe the data of one direction is spliced through */
+struct SplicePipe {
+	int read_fd;
+	int write_fd;
+	/** Bytes in the pipe not yet spliced to the destination socket */
+	size_t pending;
+};
+
 class Session: public boost::enable_shared_from_this<Session>
 {
 public:
@@ -26,26 +86,66 @@ public:
 	void client_start(const std::string& host, unsigned short port);
 	void terminate();
 private:
+	/** Keeps _slot */
+	friend class PortListener;
+
     static void termination_routine(boost::shared_ptr<Session> session);
+    static void terminate_routine(boost::shared_ptr<Session> session);
 
     static void handle_server_connect(const boost::system::error_code& err, boost::shared_ptr<Session> session);
-    static void handle_receive_from_client(const boost::system::error_code& err, boost::shared_ptr<Session> session, size_t size);
-    static void handle_send_to_client(const boost::system::error_code& err, boost::shared_ptr<Session> session);
-    static void handle_receive_from_server(const boost::system::error_code& err, boost::shared_ptr<Session> session, size_t size);
-    static void handle_send_to_server(const boost::system::error_code& err, boost::shared_ptr<Session> session);
+    static void handle_receive(
+        const boost::system::error_code& err, boost::shared_ptr<Session> session,
+        boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, BufferRing* ring, size_t size
+    );
+    static void handle_send(
+        const boost::system::error_code& err, boost::shared_ptr<Session> session,
+        boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, BufferRing* ring
+    );
+
+    static bool is_disconnect(const boost::system::error_code& err);
+    static void handle_splice_readable(
+        const boost::system::error_code& err, boost::shared_ptr<Session> session,
+        boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, SplicePipe* pipe
+    );
+    static void handle_splice_writable(
+        const boost::system::error_code& err, boost::shared_ptr<Session> session,
+        boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, SplicePipe* pipe
+    );
 
-	void receive_from_client();
-	void send_to_client(size_t size);
-	void receive_from_server();
-	void send_to_server(size_t size);
+	/** Receives the next chunk of the direction unless the ring is full */
+	void receive(boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, BufferRing* ring);
+	/** Sends the oldest chunk of the direction unless a send is in progress */
+	void send(boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, BufferRing* ring);
+	/** Picks the size of the next buffer by how much of the last one has been filled */
+	void adapt_buffer_size(BufferRing* ring, size_t buffer_size, size_t size);
+
+	/** Creates the pipes and switches the sockets to the non-blocking mode for splice()
+	  *  @return false if splice() cannot be used
+	  */
+	bool open_pipes();
+	/** Waits for the data on the source socket of the direction */
+	void splice_receive(boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, SplicePipe* pipe);
+	/** Moves the available data from the source socket to the pipe */
+	void splice_transfer(boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, SplicePipe* pipe);
+	/** Moves the data from the pipe to the destination socket, then waits for more */
+	void splice_flush(boost::asio::ip::tcp::socket* from, boost::asio::ip::tcp::socket* to, SplicePipe* pipe);
 
 	PortListener* _listener;
+	/** Index of the session in the sessions of the listener, guarded by the listener */
+	size_t _slot;
+	SessionOptions _options;
+
+	/** Serializes the handlers of the session on the io_service pool */
+	boost::asio::io_service::strand _strand;
 
 	boost::asio::ip::tcp::socket _server_socket;
 	boost::asio::ip::tcp::socket _client_socket;
 
-	unsigned char _server_read_buffer[BUFFER_SIZE];
-	unsigned char _client_read_buffer[BUFFER_SIZE];
+	BufferRing _client_to_server_ring;
+	BufferRing _server_to_client_ring;
+
+	SplicePipe _client_to_server_pipe;
+	SplicePipe _server_to_client_pipe;
 
 	bool _is_to_be_terminated;
 	bool _client_is_connected;